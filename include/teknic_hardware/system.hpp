@@ -2,8 +2,18 @@
 #ifndef TEKNIC_HARDWARE__SYSTEM_HPP_
 #define TEKNIC_HARDWARE__SYSTEM_HPP_
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "hardware_interface/handle.hpp"
@@ -72,16 +82,90 @@ public:
 private:
   std::vector<double> hw_commands_positions_;
   std::vector<double> hw_commands_velocities_;
+  // streaming joints only, a new segment_id queues segment as the next move
+  std::vector<double> hw_commands_segments_;
+  std::vector<double> hw_commands_segment_ids_;
+
+  // node settings that can be changed at runtime through extra command interfaces,
+  // they are independent of the control mode and applied before the next move
+  enum setting_t
+  {
+    VEL_LIMIT,
+    ACC_LIMIT,
+    JERK_LIMIT,
+    SETTING_COUNT
+  };
+  static const char * const SETTING_NAMES[SETTING_COUNT];
+  using Settings = std::array<double, SETTING_COUNT>;
+  std::vector<Settings> hw_commands_settings_;
+  // values from the URDF, restored on every activation
+  std::vector<Settings> configured_settings_;
+  // last values written to the nodes, NaN = never written
+  std::vector<Settings> applied_settings_;
+
+  static bool is_setting(const std::string & key);
+
   std::vector<double> hw_states_positions_;
   std::vector<double> hw_states_velocities_;
   std::vector<double> hw_states_efforts_;
+  std::vector<double> hw_states_ages_;
+  std::vector<double> hw_states_move_done_;
+  std::vector<double> hw_states_faults_;
+  std::vector<double> hw_states_stale_;
+  std::vector<double> hw_states_time_to_target_;
+  std::vector<double> hw_states_write_decimation_;
+  std::vector<double> hw_states_segments_queued_;
 
+  // revolutions per rad or m, never scaled in place (see JointHandle::to_counts)
   std::vector<double> counts_conversions_;
   std::vector<int> homing_;
+  // joints of a homing group home together, groups run in ascending order (-1 = alone)
+  std::vector<int> homing_groups_;
   std::vector<double> peak_torques_;
   std::vector<double> feed_constants_;
   std::vector<bool> read_only_;
 
+  // state interfaces declared in the URDF, only these are exported and refreshed
+  struct ReadSet
+  {
+    bool position = true;
+    bool velocity = true;
+    bool effort = false;
+    bool age = false;
+    bool move_done = false;
+    bool fault = false;
+    bool stale = false;
+    bool time_to_target = false;
+    bool write_decimation = false;
+    // slower signals are only refreshed every nth read cycle
+    unsigned velocity_decimation = 1;
+    unsigned effort_decimation = 1;
+    // derive the velocity from the position instead of reading it
+    bool estimate_velocity = false;
+  };
+  std::vector<ReadSet> read_sets_;
+
+  // host side velocity estimation from timestamped position samples
+  enum velocity_filter_t
+  {
+    FINITE_DIFFERENCE,
+    ALPHA_BETA
+  };
+  struct VelocityEstimator
+  {
+    velocity_filter_t filter = FINITE_DIFFERENCE;
+    double alpha = 0.5;
+    double beta = 0.1;
+
+    bool initialized = false;
+    double position = 0;
+    double velocity = 0;
+    double stamp = 0;
+
+    double update(double measured_position, double measured_stamp);
+  };
+  std::vector<VelocityEstimator> velocity_estimators_;
+
   double count = 0;
 
   sFnd::SysManager* myMgr = sFnd::SysManager::Instance();
@@ -92,15 +176,334 @@ private:
   {
     SPEED_LOOP,
     POSITION_LOOP,
+    SEGMENT_STREAM,
     UNDEFINED
   };
 
+  // kinematic profile of position moves
+  enum move_profile_t
+  {
+    TRAPEZOIDAL,  // symmetric, acc_limit for acceleration and deceleration
+    ASYMMETRIC,   // acc_limit for acceleration, dec_limit for deceleration
+    HEAD_TAIL     // head_tail_vel_limit at the start and the end of the move
+  };
+  std::vector<move_profile_t> move_profiles_;
+
+  // nodes resolved on activation, iterated by the hot paths instead of Ports()/Nodes()
+  struct JointHandle
+  {
+    sFnd::INode * node = nullptr;
+    double to_counts = 0;     // counts per rad or m
+    double from_counts = 0;   // rad or m per count
+    double effort_scale = 0;  // effort per percent of peak torque
+    bool read_only = false;
+    std::size_t port = 0;
+    std::size_t trigger_group = 0;  // 0 = moves start immediately
+    move_profile_t profile = TRAPEZOIDAL;
+    bool has_head = false;
+    bool has_tail = false;
+    bool streaming = false;
+  };
+  std::vector<JointHandle> handles_;
+
+  // in sync write mode moves are loaded as triggered moves and every
+  // (port, trigger group) pair is released at once at the end of write()
+  bool sync_write_ = false;
+  std::vector<std::size_t> trigger_groups_;
+  std::vector<std::pair<std::size_t, std::size_t>> pending_triggers_;
+
+  void add_trigger(const JointHandle & handle);
+  void send_command(std::size_t i, control_mode_t mode, double target);
+  void apply_setting(const JointHandle & handle, setting_t setting, double value);
+  std::size_t start_move(const JointHandle & handle, control_mode_t mode, double target);
+  double move_duration_msec(const JointHandle & handle, double distance);
+
+  // streaming joints take segments ahead of time through the segment interfaces, queue
+  // them on the host and keep the move buffer of the node topped up with them as
+  // non-interrupting moves, paced by the predicted durations
+  static constexpr std::size_t MOVE_BUFFER_DEPTH = 16;
+  struct Stream
+  {
+    std::deque<double> pending;  // targets in counts not yet sent, at most MOVE_BUFFER_DEPTH
+    std::deque<double> finish;   // predicted end of the segments on the node
+    std::size_t free = MOVE_BUFFER_DEPTH;
+    double last_target = std::numeric_limits<double>::quiet_NaN();
+    double last_id = std::numeric_limits<double>::quiet_NaN();
+    bool overflow = false;
+  };
+  std::vector<bool> streaming_;
+  std::vector<Stream> streams_;
+
+  void feed_stream(std::size_t i);
+
+  // predicted end of the last commanded move, without attention move_done follows
+  // this prediction and is only confirmed with MoveIsDone every move_done_check_
+  std::vector<double> move_ends_;
+  std::vector<double> next_move_checks_;
+  double move_done_check_ = 0.1;
+
+  bool predicts_moves(std::size_t i) const;
+  void predict_move(std::size_t i, control_mode_t mode, double target);
+
+  // lock-free latest-wins handoff between one producer and one consumer thread: the
+  // producer fills back() and publishes it, consume() swaps the newest one into front()
+  template<typename T>
+  struct TripleBuffer
+  {
+    static constexpr std::uint8_t FRESH = 0x4;
+    static constexpr std::uint8_t INDEX = 0x3;
+    std::array<T, 3> slots;
+    std::atomic<std::uint8_t> latest {1};
+    std::uint8_t back_index = 0;
+    std::uint8_t front_index = 2;
+
+    T & back() {return slots[back_index];}
+    const T & front() const {return slots[front_index];}
+    bool fresh() const {return latest.load() & FRESH;}
+    void publish() {back_index = latest.exchange(back_index | FRESH) & INDEX;}
+    bool consume()
+    {
+      if (!fresh()) {return false;}
+      front_index = latest.exchange(front_index) & INDEX;
+      return true;
+    }
+  };
+
+  // async write mode: write() hands the commands of each port to a sender thread
+  // through a latest-wins triple buffer and never touches the link itself
+  struct QueuedCommand
+  {
+    control_mode_t mode = UNDEFINED;
+    double target = std::numeric_limits<double>::quiet_NaN();
+    // bumped by write() for every command that has to be sent
+    std::uint64_t seq = 0;
+    Settings settings;
+    std::uint64_t settings_seq = 0;
+  };
+  std::vector<QueuedCommand> queued_commands_;
+
+  // cubic Hermite segment from the current interpolated state to the newest position
+  // command, its duration is the measured interval between commands
+  struct Spline
+  {
+    bool enabled = false;
+    bool active = false;
+    bool settled = true;
+    double t0 = 0;
+    double duration = 0;
+    double p0 = 0;
+    double v0 = 0;
+    double p1 = 0;
+    double v1 = 0;
+    double last_arrival = std::numeric_limits<double>::quiet_NaN();
+    double last_target = std::numeric_limits<double>::quiet_NaN();
+
+    void sample(double t, double & p, double & v) const;
+  };
+  std::vector<bool> interpolated_;
+  double interpolation_period_ = 0.002;
+
+  struct CommandWorker
+  {
+    std::size_t port;
+    std::vector<std::size_t> joints;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stop = false;
+    std::atomic<bool> failed {false};
+    sFnd::mnErr error;
+
+    // commands of the port: write() fills back, the sender drains front
+    TripleBuffer<std::vector<QueuedCommand>> buffer;
+
+    // last sequence number sent per joint, a skipped buffer is caught up by the next one
+    std::vector<std::uint64_t> sent;
+    std::vector<std::uint64_t> settings_sent;
+    std::vector<std::size_t> triggers;
+
+    // interpolated joints, their splines are sampled every interpolation period
+    std::vector<Spline> splines;
+    bool interpolating = false;
+  };
+  std::vector<std::unique_ptr<CommandWorker>> command_workers_;
+  bool async_write_ = false;
+
+  void start_command_workers();
+  void stop_command_workers();
+  void command_worker_loop(CommandWorker & worker);
+  void interpolate_command(
+    CommandWorker & worker, std::size_t k, const QueuedCommand & command);
+  void interpolate_tick(CommandWorker & worker);
+
+  // attention packets are received by one thread per port and posted as
+  // status bits into per-joint flags that read() consumes
+  struct AttnWorker
+  {
+    std::size_t port;
+    std::array<std::size_t, MN_API_MAX_NODES> joints;
+    std::thread thread;
+  };
+  std::vector<std::unique_ptr<AttnWorker>> attn_workers_;
+  std::vector<std::atomic<std::uint32_t>> attn_events_;
+  std::atomic<bool> attn_stop_ {false};
+  bool attention_ = false;
+  mnStatusReg attn_mask_;
+  // posting is enabled on the ports and the node masks may be set
+  bool attn_armed_ = false;
+
+  void start_attn_workers();
+  void stop_attn_workers();
+  void disarm_attention();
+  void attn_worker_loop(AttnWorker & worker);
+
   // command mode switch variables
   std::vector<bool> stop_modes_;
   std::vector<control_mode_t> start_modes_;
 
   // active control mode for each actuator
   std::vector<control_mode_t> control_mode_;
+
+  // last target sent to each actuator in counts or counts/s, a NaN target forces a resend
+  struct SentCommand
+  {
+    double target = std::numeric_limits<double>::quiet_NaN();
+    unsigned cycles = 0;
+  };
+  std::vector<SentCommand> sent_commands_;
+  // commands within the deadband of the last target are not sent again
+  std::vector<double> position_deadbands_;
+  std::vector<double> velocity_deadbands_;
+  // resend an unchanged command after this many write cycles (0 = never)
+  unsigned keep_alive_cycles_ = 0;
+
+  bool command_changed(std::size_t i, double target, double deadband);
+
+  // link governor: every port may only spend link_budget_ of the write period on
+  // motion commands, the rest is deferred to later cycles where the newest target wins
+  struct PortGovernor
+  {
+    // smoothed duration of one motion command transaction in seconds,
+    // also updated by the sender thread in async write mode
+    std::atomic<double> transaction {0};
+    std::size_t budget = 0;
+    std::size_t sent = 0;
+    std::size_t deferred = 0;
+    // smoothed ratio of wanted to sent commands, 1 = nothing deferred
+    double decimation = 1;
+  };
+  std::vector<PortGovernor> governors_;
+  bool link_governor_ = false;
+  double link_budget_ = 0.5;
+  unsigned port_rate_ = MN_BAUD_12X;
+  // rotates the joint order of write() so that no joint starves under the governor
+  std::size_t write_offset_ = 0;
+
+  void measure_transaction(std::size_t port, double seconds);
+
+  // latest measurement of a joint in ros2_control units
+  struct JointSample
+  {
+    double position = std::numeric_limits<double>::quiet_NaN();
+    double velocity = std::numeric_limits<double>::quiet_NaN();
+    double effort = std::numeric_limits<double>::quiet_NaN();
+    // steady clock time of the position measurement in seconds
+    double stamp = std::numeric_limits<double>::quiet_NaN();
+  };
+
+  // single position read of the pipelined read engine
+  struct RawRequest
+  {
+    std::size_t joint;  // index into PortWorker::joints
+    nodeaddr addr;
+    nodeparam param;
+  };
+
+  // one read worker per port, refreshing the nodes of that port concurrently
+  struct PortWorker
+  {
+    std::size_t port;
+    std::vector<std::size_t> joints;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::uint64_t requested = 0;
+    std::uint64_t completed = 0;
+    bool stop = false;
+    std::atomic<bool> failed {false};
+    sFnd::mnErr error;
+
+    // read deadline bookkeeping, only touched by read()
+    double last_update = 0;
+    unsigned consecutive_misses = 0;
+    std::uint64_t total_misses = 0;
+
+    // samples of the port: the worker fills back, read() copies front
+    TripleBuffer<std::vector<JointSample>> buffer;
+
+    // samples carried over between cycles, decimated signals keep their last value
+    std::vector<JointSample> working;
+    std::uint64_t cycle = 0;
+
+    // request list of the pipelined read engine, built once per activation
+    std::vector<RawRequest> requests;
+    std::vector<std::int64_t> responses;
+    // commands in flight on the port, restored to the default on deactivation
+    nodeulong queue_limit = 0;
+  };
+  std::vector<std::unique_ptr<PortWorker>> port_workers_;
+
+  // poll continuously in the background instead of on every read()
+  bool background_read_ = false;
+
+  // a port that misses this deadline keeps its last values and is marked stale,
+  // read() only fails after max_read_misses_ consecutive misses (0 = no deadline)
+  std::chrono::duration<double> read_deadline_ {0};
+  unsigned max_read_misses_ = 10;
+
+  // latest sample of every joint, kept to age and extrapolate it on every read()
+  std::vector<JointSample> latest_samples_;
+  // extrapolate positions to the time of read() with the velocity
+  bool extrapolate_position_ = false;
+
+  // send the position requests of a port before collecting the responses
+  bool pipelined_read_ = false;
+
+  // static node information keyed by serial number, kept across activations and
+  // optionally persisted to node_info_file_
+  struct NodeInfo
+  {
+    std::uint32_t serial = 0;
+    std::uint32_t resolution = 0;
+    int type = 0;
+    std::string firmware;
+    std::string model;
+    std::string user_id;
+  };
+  std::map<std::uint32_t, NodeInfo> node_info_;
+  std::string node_info_file_;
+  bool node_info_dirty_ = false;
+
+  const NodeInfo & lookup_node_info(sFnd::INode & inode);
+  void load_node_info();
+  void save_node_info();
+
+  // status polling interval during activation if attention is disabled
+  double activation_poll_ms_ = 10;
+
+  void wait_for_status(
+    std::vector<std::size_t> & joints, mnStatusReg bits, double timeout_ms, const char * what);
+  bool home_joints(const std::vector<std::size_t> & joints);
+
+  void start_port_workers();
+  void stop_port_workers();
+  void port_worker_loop(PortWorker & worker);
+  void refresh_joint(std::size_t i, JointSample & sample, std::uint64_t slot);
+  void refresh_rates(std::size_t i, JointSample & sample, std::uint64_t slot);
+  void refresh_port_pipelined(PortWorker & worker, std::vector<JointSample> & samples);
+  void exchange_raw(
+    std::size_t port, const std::vector<RawRequest> & requests, std::size_t window,
+    std::vector<std::int64_t> & responses);
 };
 
 }  // namespace teknic_hardware
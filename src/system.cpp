@@ -1,16 +1,55 @@
 #include "teknic_hardware/system.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
 #include <vector>
 
 #include "hardware_interface/types/hardware_interface_type_values.hpp"
 #include "rclcpp/rclcpp.hpp"
+#include "sFoundation/lnkAccessAPI.h"
+#include "sFoundation/pubCpmRegs.h"
 
 #define ENABLE_TIMEOUT	3000
 #define HOMING_TIMEOUT  50000
+#define ONLINE_TIMEOUT  15000
+// sFoundation's command queue limit per port and its allowed maximum
+#define CMD_QUEUE_DEFAULT 3
+#define CMD_QUEUE_MAX     14
 
 namespace teknic_hardware
 {
+const char * const TeknicSystemHardware::SETTING_NAMES[SETTING_COUNT] = {
+  "vel_limit", "acc_limit", "jerk_limit"};
+
+namespace
+{
+double steady_seconds()
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+}  // namespace
+
+// settings interfaces can be claimed alongside any control mode
+bool TeknicSystemHardware::is_setting(const std::string & key)
+{
+  std::string name = key.substr(key.find("/") + 1);
+  for (const char * setting : SETTING_NAMES)
+  {
+    if (name == setting)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
 TeknicSystemHardware::~TeknicSystemHardware()
 {
   // If the controller manager is shutdown via Ctrl + C
@@ -31,9 +70,156 @@ hardware_interface::CallbackReturn TeknicSystemHardware::on_init(
   hw_states_positions_.resize(info_.joints.size(), std::numeric_limits<double>::quiet_NaN());
   hw_states_velocities_.resize(info_.joints.size(), std::numeric_limits<double>::quiet_NaN());
   hw_states_efforts_.resize(info_.joints.size(), std::numeric_limits<double>::quiet_NaN());
+  hw_states_ages_.resize(info_.joints.size(), std::numeric_limits<double>::quiet_NaN());
+  hw_states_move_done_.resize(info_.joints.size(), std::numeric_limits<double>::quiet_NaN());
+  hw_states_faults_.resize(info_.joints.size(), std::numeric_limits<double>::quiet_NaN());
+  hw_states_stale_.resize(info_.joints.size(), 0);
+  hw_states_time_to_target_.resize(info_.joints.size(), 0);
+  hw_states_write_decimation_.resize(info_.joints.size(), 1);
+  hw_states_segments_queued_.resize(info_.joints.size(), 0);
+  move_ends_.resize(info_.joints.size(), 0);
+  next_move_checks_.resize(info_.joints.size(), 0);
+  attn_events_ = std::vector<std::atomic<std::uint32_t>>(info_.joints.size());
+  latest_samples_.resize(info_.joints.size());
   hw_commands_positions_.resize(info_.joints.size(), std::numeric_limits<double>::quiet_NaN());
   hw_commands_velocities_.resize(info_.joints.size(), std::numeric_limits<double>::quiet_NaN());
+  hw_commands_segments_.resize(info_.joints.size(), std::numeric_limits<double>::quiet_NaN());
+  hw_commands_segment_ids_.resize(info_.joints.size(), std::numeric_limits<double>::quiet_NaN());
+  Settings unset;
+  unset.fill(std::numeric_limits<double>::quiet_NaN());
+  hw_commands_settings_.resize(info_.joints.size(), unset);
+  configured_settings_.resize(info_.joints.size(), unset);
+  applied_settings_.resize(info_.joints.size(), unset);
   control_mode_.resize(info_.joints.size(), control_mode_t::UNDEFINED);
+  sent_commands_.resize(info_.joints.size());
+
+  if (info_.hardware_parameters.count("read_mode") != 0)
+  {
+    std::string read_mode = info_.hardware_parameters.at("read_mode");
+    if (read_mode == "background")
+    {
+      background_read_ = true;
+    }
+    else if (read_mode != "sync")
+    {
+      RCLCPP_FATAL(
+        rclcpp::get_logger("TeknicSystemHardware"),
+        "read_mode must be sync or background");
+      return hardware_interface::CallbackReturn::ERROR;
+    }
+  }
+  if (info_.hardware_parameters.count("read_deadline_ms") != 0)
+  {
+    read_deadline_ = std::chrono::duration<double>(
+      std::stod(info_.hardware_parameters.at("read_deadline_ms")) / 1000);
+  }
+  if (info_.hardware_parameters.count("max_read_misses") != 0)
+  {
+    max_read_misses_ = std::stoul(info_.hardware_parameters.at("max_read_misses"));
+    if (max_read_misses_ == 0)
+    {
+      RCLCPP_FATAL(
+        rclcpp::get_logger("TeknicSystemHardware"),
+        "max_read_misses must be at least 1");
+      return hardware_interface::CallbackReturn::ERROR;
+    }
+  }
+  if (info_.hardware_parameters.count("write_mode") != 0)
+  {
+    std::string write_mode = info_.hardware_parameters.at("write_mode");
+    if (write_mode == "async")
+    {
+      async_write_ = true;
+    }
+    else if (write_mode != "sync")
+    {
+      RCLCPP_FATAL(
+        rclcpp::get_logger("TeknicSystemHardware"),
+        "write_mode must be sync or async");
+      return hardware_interface::CallbackReturn::ERROR;
+    }
+  }
+  if (info_.hardware_parameters.count("sync_write") != 0 &&
+    std::stoi(info_.hardware_parameters.at("sync_write")) == 1)
+  {
+    sync_write_ = true;
+  }
+  if (info_.hardware_parameters.count("move_done_check_ms") != 0)
+  {
+    move_done_check_ = std::stod(info_.hardware_parameters.at("move_done_check_ms")) / 1000;
+  }
+  if (info_.hardware_parameters.count("interpolation_rate") != 0)
+  {
+    double rate = std::stod(info_.hardware_parameters.at("interpolation_rate"));
+    if (!(rate > 0))
+    {
+      RCLCPP_FATAL(
+        rclcpp::get_logger("TeknicSystemHardware"),
+        "interpolation_rate must be positive");
+      return hardware_interface::CallbackReturn::ERROR;
+    }
+    interpolation_period_ = 1 / rate;
+  }
+  if (info_.hardware_parameters.count("activation_poll_ms") != 0)
+  {
+    activation_poll_ms_ = std::stod(info_.hardware_parameters.at("activation_poll_ms"));
+  }
+  if (info_.hardware_parameters.count("node_info_file") != 0)
+  {
+    node_info_file_ = info_.hardware_parameters.at("node_info_file");
+    load_node_info();
+  }
+  if (info_.hardware_parameters.count("port_rate") != 0)
+  {
+    port_rate_ = std::stoul(info_.hardware_parameters.at("port_rate"));
+    if (port_rate_ != MN_BAUD_12X && port_rate_ != MN_BAUD_24X && port_rate_ != MN_BAUD_48X &&
+      port_rate_ != MN_BAUD_96X && port_rate_ != MN_BAUD_108X)
+    {
+      RCLCPP_FATAL(
+        rclcpp::get_logger("TeknicSystemHardware"),
+        "port_rate must be 115200, 230400, 460800, 921600 or 1036800");
+      return hardware_interface::CallbackReturn::ERROR;
+    }
+  }
+  if (info_.hardware_parameters.count("link_governor") != 0 &&
+    std::stoi(info_.hardware_parameters.at("link_governor")) == 1)
+  {
+    link_governor_ = true;
+  }
+  if (info_.hardware_parameters.count("link_budget") != 0)
+  {
+    link_budget_ = std::stod(info_.hardware_parameters.at("link_budget"));
+  }
+  if (info_.hardware_parameters.count("keep_alive_cycles") != 0)
+  {
+    keep_alive_cycles_ = std::stoul(info_.hardware_parameters.at("keep_alive_cycles"));
+  }
+  if (info_.hardware_parameters.count("extrapolate_position") != 0 &&
+    std::stoi(info_.hardware_parameters.at("extrapolate_position")) == 1)
+  {
+    extrapolate_position_ = true;
+  }
+  if (info_.hardware_parameters.count("attention") != 0 &&
+    std::stoi(info_.hardware_parameters.at("attention")) == 1)
+  {
+    attention_ = true;
+    attn_mask_.cpm.MoveDone = 1;
+    attn_mask_.cpm.NotReady = 1;
+    attn_mask_.cpm.UserAlert = 1;
+  }
+  if (info_.hardware_parameters.count("pipelined_read") != 0 &&
+    std::stoi(info_.hardware_parameters.at("pipelined_read")) == 1)
+  {
+    // the untracked responses must not interleave with other traffic on the port
+    if (background_read_ || async_write_ || read_deadline_.count() > 0)
+    {
+      RCLCPP_FATAL(
+        rclcpp::get_logger("TeknicSystemHardware"),
+        "pipelined_read requires read_mode sync, write_mode sync and no read_deadline_ms");
+      return hardware_interface::CallbackReturn::ERROR;
+    }
+    pipelined_read_ = true;
+  }
 
   for (const hardware_interface::ComponentInfo & joint : info_.joints)
   {
@@ -107,6 +293,250 @@ hardware_interface::CallbackReturn TeknicSystemHardware::on_init(
     {
       read_only_.emplace_back(false);
     }
+
+    if (joint.parameters.count("homing_group") != 0)
+    {
+      // any negative group means the joint homes alone
+      homing_groups_.emplace_back(std::max(-1, std::stoi(joint.parameters.at("homing_group"))));
+    }
+    else
+    {
+      homing_groups_.emplace_back(-1);
+    }
+
+    move_profile_t profile = TRAPEZOIDAL;
+    if (joint.parameters.count("move_profile") != 0)
+    {
+      std::string name = joint.parameters.at("move_profile");
+      if (name == "asymmetric" && joint.parameters.count("dec_limit") != 0)
+      {
+        profile = ASYMMETRIC;
+      }
+      else if (name == "head_tail" && joint.parameters.count("head_tail_vel_limit") != 0)
+      {
+        profile = HEAD_TAIL;
+      }
+      else if (name != "trapezoidal")
+      {
+        RCLCPP_FATAL(
+          rclcpp::get_logger("TeknicSystemHardware"),
+          "move_profile of joint %s must be trapezoidal, asymmetric (requires dec_limit) "
+          "or head_tail (requires head_tail_vel_limit)", joint.name.c_str());
+        return hardware_interface::CallbackReturn::ERROR;
+      }
+    }
+    move_profiles_.emplace_back(profile);
+
+    if (joint.parameters.count("streaming") != 0 && std::stoi(joint.parameters.at("streaming")) == 1)
+    {
+      if (async_write_)
+      {
+        RCLCPP_FATAL(
+          rclcpp::get_logger("TeknicSystemHardware"),
+          "Streaming joint %s requires write_mode sync", joint.name.c_str());
+        return hardware_interface::CallbackReturn::ERROR;
+      }
+      streaming_.emplace_back(true);
+    }
+    else
+    {
+      streaming_.emplace_back(false);
+    }
+
+    if (joint.parameters.count("interpolation") != 0)
+    {
+      std::string interpolation = joint.parameters.at("interpolation");
+      // the ticks of the sender threads are not charged to the link governor
+      if (interpolation == "cubic" && async_write_ && !streaming_.back() && !link_governor_)
+      {
+        interpolated_.emplace_back(true);
+      }
+      else if (interpolation == "none")
+      {
+        interpolated_.emplace_back(false);
+      }
+      else
+      {
+        RCLCPP_FATAL(
+          rclcpp::get_logger("TeknicSystemHardware"),
+          "interpolation of joint %s must be none or cubic (requires write_mode async, "
+          "no streaming and no link_governor)", joint.name.c_str());
+        return hardware_interface::CallbackReturn::ERROR;
+      }
+    }
+    else
+    {
+      interpolated_.emplace_back(false);
+    }
+
+    // the delay follows from the jerk limit, the node only reports it
+    if (joint.parameters.count("jerk_delay") != 0)
+    {
+      RCLCPP_WARN(
+        rclcpp::get_logger("TeknicSystemHardware"),
+        "jerk_delay of joint %s is ignored, it is derived from jerk_limit", joint.name.c_str());
+    }
+
+    // initial values of the runtime settings
+    Settings & settings = configured_settings_[move_profiles_.size() - 1];
+    for (std::size_t s = 0; s < SETTING_COUNT; s++)
+    {
+      if (joint.parameters.count(SETTING_NAMES[s]) != 0)
+      {
+        settings[s] = std::stod(joint.parameters.at(SETTING_NAMES[s]));
+      }
+    }
+    double jerk = settings[JERK_LIMIT];
+    if (!std::isnan(jerk) &&
+      (jerk < 0 || jerk > std::numeric_limits<unsigned>::max() || jerk != std::floor(jerk)))
+    {
+      RCLCPP_FATAL(
+        rclcpp::get_logger("TeknicSystemHardware"),
+        "jerk_limit of joint %s must be a non-negative integer", joint.name.c_str());
+      return hardware_interface::CallbackReturn::ERROR;
+    }
+
+    ReadSet read_set;
+    read_set.effort = peak_torques_.back() != 0;
+    if (!joint.state_interfaces.empty())
+    {
+      read_set.position = false;
+      read_set.velocity = false;
+      read_set.effort = false;
+      for (const hardware_interface::InterfaceInfo & state_interface : joint.state_interfaces)
+      {
+        if (state_interface.name == hardware_interface::HW_IF_POSITION)
+        {
+          read_set.position = true;
+        }
+        else if (state_interface.name == hardware_interface::HW_IF_VELOCITY)
+        {
+          read_set.velocity = true;
+        }
+        else if (state_interface.name == hardware_interface::HW_IF_EFFORT)
+        {
+          if (peak_torques_.back() == 0)
+          {
+            RCLCPP_FATAL(
+              rclcpp::get_logger("TeknicSystemHardware"),
+              "Effort state interface of joint %s requires peak_torque", joint.name.c_str());
+            return hardware_interface::CallbackReturn::ERROR;
+          }
+          read_set.effort = true;
+        }
+        else if (state_interface.name == "age")
+        {
+          read_set.age = true;
+        }
+        else if (state_interface.name == "stale")
+        {
+          read_set.stale = true;
+        }
+        else if (state_interface.name == "time_to_target")
+        {
+          read_set.time_to_target = true;
+        }
+        else if (state_interface.name == "write_decimation")
+        {
+          read_set.write_decimation = true;
+        }
+        else if (state_interface.name == "move_done")
+        {
+          read_set.move_done = true;
+        }
+        else if (state_interface.name == "fault")
+        {
+          if (!attention_)
+          {
+            RCLCPP_FATAL(
+              rclcpp::get_logger("TeknicSystemHardware"),
+              "State interface %s of joint %s requires attention",
+              state_interface.name.c_str(), joint.name.c_str());
+            return hardware_interface::CallbackReturn::ERROR;
+          }
+          read_set.fault = true;
+        }
+        else
+        {
+          RCLCPP_WARN(
+            rclcpp::get_logger("TeknicSystemHardware"),
+            "Unknown state interface %s of joint %s is ignored",
+            state_interface.name.c_str(), joint.name.c_str());
+        }
+      }
+    }
+    if (joint.parameters.count("trigger_group") != 0)
+    {
+      trigger_groups_.emplace_back(std::stoul(joint.parameters.at("trigger_group")));
+    }
+    else
+    {
+      trigger_groups_.emplace_back(1);
+    }
+
+    // deadbands in counts and counts/s
+    double position_deadband = 0;
+    double velocity_deadband = 0;
+    if (joint.parameters.count("position_deadband") != 0)
+    {
+      position_deadband = std::stod(joint.parameters.at("position_deadband"));
+    }
+    if (joint.parameters.count("velocity_deadband") != 0)
+    {
+      velocity_deadband = std::stod(joint.parameters.at("velocity_deadband"));
+    }
+    position_deadbands_.emplace_back(position_deadband);
+    velocity_deadbands_.emplace_back(velocity_deadband);
+    if (joint.parameters.count("velocity_decimation") != 0)
+    {
+      read_set.velocity_decimation = std::max(1, std::stoi(joint.parameters.at("velocity_decimation")));
+    }
+    if (joint.parameters.count("effort_decimation") != 0)
+    {
+      read_set.effort_decimation = std::max(1, std::stoi(joint.parameters.at("effort_decimation")));
+    }
+
+    VelocityEstimator estimator;
+    if (joint.parameters.count("velocity_source") != 0)
+    {
+      std::string source = joint.parameters.at("velocity_source");
+      if (source == "estimated")
+      {
+        read_set.estimate_velocity = read_set.velocity;
+      }
+      else if (source != "measured")
+      {
+        RCLCPP_FATAL(
+          rclcpp::get_logger("TeknicSystemHardware"),
+          "velocity_source of joint %s must be measured or estimated", joint.name.c_str());
+        return hardware_interface::CallbackReturn::ERROR;
+      }
+    }
+    if (joint.parameters.count("velocity_filter") != 0)
+    {
+      std::string filter = joint.parameters.at("velocity_filter");
+      if (filter == "alpha_beta")
+      {
+        estimator.filter = ALPHA_BETA;
+      }
+      else if (filter != "difference")
+      {
+        RCLCPP_FATAL(
+          rclcpp::get_logger("TeknicSystemHardware"),
+          "velocity_filter of joint %s must be difference or alpha_beta", joint.name.c_str());
+        return hardware_interface::CallbackReturn::ERROR;
+      }
+    }
+    if (joint.parameters.count("velocity_alpha") != 0)
+    {
+      estimator.alpha = std::stod(joint.parameters.at("velocity_alpha"));
+    }
+    if (joint.parameters.count("velocity_beta") != 0)
+    {
+      estimator.beta = std::stod(joint.parameters.at("velocity_beta"));
+    }
+    velocity_estimators_.emplace_back(estimator);
+    read_sets_.emplace_back(read_set);
   }
 
   return hardware_interface::CallbackReturn::SUCCESS;
@@ -117,11 +547,88 @@ hardware_interface::CallbackReturn TeknicSystemHardware::on_configure(
 {
   try
   {
+    double start = steady_seconds();
     for (size_t pc = 0; pc < chports.size(); pc++)
     {
-      myMgr->ComHubPort(pc, chports[pc].c_str());
+      myMgr->ComHubPort(pc, chports[pc].c_str(), static_cast<netRates>(port_rate_));
     }
     myMgr->PortsOpen(chports.size());
+    double opened = steady_seconds();
+    RCLCPP_INFO(
+      rclcpp::get_logger("TeknicSystemHardware"),
+      "Opened %zu ports in %.3f s", chports.size(), opened - start);
+
+    // every hub comes online on its own, wait for all of them at once
+    std::vector<char> online(chports.size(), 0);
+    std::vector<double> online_times(chports.size(), 0);
+    std::vector<std::thread> waiters;
+    for (size_t pc = 0; pc < chports.size(); pc++)
+    {
+      waiters.emplace_back([this, pc, opened, &online, &online_times] {
+          try
+          {
+            online[pc] = myMgr->Ports(pc).WaitForOnline(ONLINE_TIMEOUT);
+          }
+          catch(sFnd::mnErr&)
+          {
+            online[pc] = 0;
+          }
+          online_times[pc] = steady_seconds() - opened;
+        });
+    }
+    for (std::thread & waiter : waiters)
+    {
+      waiter.join();
+    }
+
+    bool failed = false;
+    for (size_t pc = 0; pc < chports.size(); pc++)
+    {
+      sFnd::IPort &myPort = myMgr->Ports(pc);
+      if (!online[pc])
+      {
+        RCLCPP_ERROR(
+          rclcpp::get_logger("TeknicSystemHardware"),
+          "Port[%zu] %s did not come online within %d ms", pc, chports[pc].c_str(), ONLINE_TIMEOUT);
+        failed = true;
+        continue;
+      }
+      RCLCPP_INFO(
+        rclcpp::get_logger("TeknicSystemHardware"),
+        "Port[%zu] online after %.3f s", pc, online_times[pc]);
+
+      // every node the URDF names on this port must have been found
+      std::size_t expected = 0;
+      for (const auto & node : nodes)
+      {
+        if (node.first == pc)
+        {
+          expected = std::max(expected, node.second + 1);
+        }
+      }
+      if (myPort.NodeCount() < expected)
+      {
+        RCLCPP_ERROR(
+          rclcpp::get_logger("TeknicSystemHardware"),
+          "Port[%zu] has %d nodes, the URDF uses %zu", pc, myPort.NodeCount(), expected);
+        failed = true;
+      }
+    }
+    if (failed)
+    {
+      myMgr->PortsClose();
+      return hardware_interface::CallbackReturn::FAILURE;
+    }
+    RCLCPP_INFO(
+      rclcpp::get_logger("TeknicSystemHardware"),
+      "All ports online after %.3f s", steady_seconds() - start);
+
+    // start from the wire time of a motion command, about 16 bytes in both directions
+    governors_ = std::vector<PortGovernor>(chports.size());
+    for (PortGovernor & governor : governors_)
+    {
+      governor.transaction = 16 * 10.0 / port_rate_;
+    }
     for (size_t i = 0; i < chports.size(); i++) {
       sFnd::IPort &myPort = myMgr->Ports(i);
       RCLCPP_INFO(
@@ -147,6 +654,8 @@ hardware_interface::CallbackReturn TeknicSystemHardware::on_configure(
 hardware_interface::CallbackReturn TeknicSystemHardware::on_cleanup(
   const rclcpp_lifecycle::State & /*previous_state*/)
 {
+  handles_.clear();
+
   try
   {
   	myMgr->PortsClose();
@@ -170,20 +679,61 @@ TeknicSystemHardware::export_state_interfaces()
   std::vector<hardware_interface::StateInterface> state_interfaces;
   for (std::size_t i = 0; i < info_.joints.size(); i++)
   {
-    state_interfaces.emplace_back(hardware_interface::StateInterface(
-      info_.joints[i].name, hardware_interface::HW_IF_POSITION, &hw_states_positions_[i]));
-    state_interfaces.emplace_back(hardware_interface::StateInterface(
-      info_.joints[i].name, hardware_interface::HW_IF_VELOCITY, &hw_states_velocities_[i]));
-    if (peak_torques_[i] != 0)
+    if (read_sets_[i].position)
+    {
+      state_interfaces.emplace_back(hardware_interface::StateInterface(
+        info_.joints[i].name, hardware_interface::HW_IF_POSITION, &hw_states_positions_[i]));
+    }
+    if (read_sets_[i].velocity)
+    {
+      state_interfaces.emplace_back(hardware_interface::StateInterface(
+        info_.joints[i].name, hardware_interface::HW_IF_VELOCITY, &hw_states_velocities_[i]));
+    }
+    if (read_sets_[i].effort)
     {
       state_interfaces.emplace_back(hardware_interface::StateInterface(
         info_.joints[i].name, hardware_interface::HW_IF_EFFORT, &hw_states_efforts_[i]));
     }
-  }
-  return state_interfaces;
-}
-
-std::vector<hardware_interface::CommandInterface>
+    if (read_sets_[i].age)
+    {
+      state_interfaces.emplace_back(hardware_interface::StateInterface(
+        info_.joints[i].name, "age", &hw_states_ages_[i]));
+    }
+    if (read_sets_[i].stale)
+    {
+      state_interfaces.emplace_back(hardware_interface::StateInterface(
+        info_.joints[i].name, "stale", &hw_states_stale_[i]));
+    }
+    if (read_sets_[i].write_decimation)
+    {
+      state_interfaces.emplace_back(hardware_interface::StateInterface(
+        info_.joints[i].name, "write_decimation", &hw_states_write_decimation_[i]));
+    }
+    if (read_sets_[i].time_to_target)
+    {
+      state_interfaces.emplace_back(hardware_interface::StateInterface(
+        info_.joints[i].name, "time_to_target", &hw_states_time_to_target_[i]));
+    }
+    if (read_sets_[i].move_done)
+    {
+      state_interfaces.emplace_back(hardware_interface::StateInterface(
+        info_.joints[i].name, "move_done", &hw_states_move_done_[i]));
+    }
+    if (read_sets_[i].fault)
+    {
+      state_interfaces.emplace_back(hardware_interface::StateInterface(
+        info_.joints[i].name, "fault", &hw_states_faults_[i]));
+    }
+    if (streaming_[i])
+    {
+      state_interfaces.emplace_back(hardware_interface::StateInterface(
+        info_.joints[i].name, "segments_queued", &hw_states_segments_queued_[i]));
+    }
+  }
+  return state_interfaces;
+}
+
+std::vector<hardware_interface::CommandInterface>
 TeknicSystemHardware::export_command_interfaces()
 {
   std::vector<hardware_interface::CommandInterface> command_interfaces;
@@ -193,6 +743,18 @@ TeknicSystemHardware::export_command_interfaces()
       info_.joints[i].name, hardware_interface::HW_IF_POSITION, &hw_commands_positions_[i]));
     command_interfaces.emplace_back(hardware_interface::CommandInterface(
       info_.joints[i].name, hardware_interface::HW_IF_VELOCITY, &hw_commands_velocities_[i]));
+    for (std::size_t s = 0; s < SETTING_COUNT; s++)
+    {
+      command_interfaces.emplace_back(hardware_interface::CommandInterface(
+        info_.joints[i].name, SETTING_NAMES[s], &hw_commands_settings_[i][s]));
+    }
+    if (streaming_[i])
+    {
+      command_interfaces.emplace_back(hardware_interface::CommandInterface(
+        info_.joints[i].name, "segment", &hw_commands_segments_[i]));
+      command_interfaces.emplace_back(hardware_interface::CommandInterface(
+        info_.joints[i].name, "segment_id", &hw_commands_segment_ids_[i]));
+    }
   }
 
   return command_interfaces;
@@ -210,6 +772,7 @@ hardware_interface::return_type TeknicSystemHardware::prepare_command_mode_switc
   // Define allowed combination of command interfaces
   std::unordered_set<std::string> vel {"velocity"};
   std::unordered_set<std::string> pos {"position"};
+  std::unordered_set<std::string> seg {"segment", "segment_id"};
   
   std::unordered_set<std::string> joint_interfaces;
   for (std::size_t i = 0; i < info_.joints.size(); i++)
@@ -218,7 +781,7 @@ hardware_interface::return_type TeknicSystemHardware::prepare_command_mode_switc
     for (std::string key : stop_interfaces)
     {
       RCLCPP_INFO(rclcpp::get_logger("CubeMarsSystemHardware"), "stop interface: %s", key.c_str());
-      if (key.find(info_.joints[i].name) != std::string::npos)
+      if (key.find(info_.joints[i].name) != std::string::npos && !is_setting(key))
       {
         stop_modes_[i] = true;
         break;
@@ -230,7 +793,7 @@ hardware_interface::return_type TeknicSystemHardware::prepare_command_mode_switc
     for (std::string key : start_interfaces)
     {
       RCLCPP_INFO(rclcpp::get_logger("CubeMarsSystemHardware"), "start interface: %s", key.c_str());
-      if (key.find(info_.joints[i].name) != std::string::npos)
+      if (key.find(info_.joints[i].name) != std::string::npos && !is_setting(key))
       {
         joint_interfaces.insert(key.substr(key.find("/") + 1));
       }
@@ -239,10 +802,14 @@ hardware_interface::return_type TeknicSystemHardware::prepare_command_mode_switc
     {
       start_modes_.push_back(SPEED_LOOP);
     }
-    else if (joint_interfaces == pos)
+    else if (joint_interfaces == pos && !streaming_[i])
     {
       start_modes_.push_back(POSITION_LOOP);
     }
+    else if (joint_interfaces == seg && streaming_[i])
+    {
+      start_modes_.push_back(SEGMENT_STREAM);
+    }
     else if (joint_interfaces.empty())
     {
       if (stop_modes_[i])
@@ -274,6 +841,20 @@ hardware_interface::return_type TeknicSystemHardware::perform_command_mode_switc
     {
       hw_commands_velocities_[i] = std::numeric_limits<double>::quiet_NaN();
       hw_commands_positions_[i] = std::numeric_limits<double>::quiet_NaN();
+      hw_commands_segments_[i] = std::numeric_limits<double>::quiet_NaN();
+      hw_commands_segment_ids_[i] = std::numeric_limits<double>::quiet_NaN();
+    }
+    // a new mode always sends its first command
+    if (control_mode_[i] != start_modes_[i])
+    {
+      sent_commands_[i] = SentCommand();
+      // segments already on the node keep running, only the unsent ones are dropped
+      if (i < streams_.size())
+      {
+        streams_[i].pending.clear();
+        streams_[i].last_target = std::numeric_limits<double>::quiet_NaN();
+        streams_[i].last_id = std::numeric_limits<double>::quiet_NaN();
+      }
     }
     // switch control mode
     control_mode_[i] = start_modes_[i];
@@ -287,102 +868,184 @@ hardware_interface::CallbackReturn TeknicSystemHardware::on_activate(
 {
   try
   {
+    handles_.resize(info_.joints.size());
+    sent_commands_.assign(info_.joints.size(), SentCommand());
+    pending_triggers_.reserve(info_.joints.size());
+    queued_commands_.assign(info_.joints.size(), QueuedCommand());
+    streams_.assign(info_.joints.size(), Stream());
+    std::fill(move_ends_.begin(), move_ends_.end(), 0);
+    if (!attention_)
+    {
+      // no move has been commanded yet
+      std::fill(hw_states_move_done_.begin(), hw_states_move_done_.end(), 1);
+    }
     for (std::size_t i = 0; i < info_.joints.size(); i++)
     {
-      std::pair<std::size_t, std::size_t> node = nodes[i];
-      sFnd::INode &inode = myMgr->Ports(node.first).Nodes(node.second);
+      handles_[i].node = &myMgr->Ports(nodes[i].first).Nodes(nodes[i].second);
+      handles_[i].read_only = read_only_[i];
+      handles_[i].port = nodes[i].first;
+      handles_[i].trigger_group = sync_write_ && !streaming_[i] ? trigger_groups_[i] : 0;
+      handles_[i].effort_scale = peak_torques_[i] / 100;
+      if (feed_constants_[i] != 0)
+      {
+        handles_[i].effort_scale *= 2 * M_PI / feed_constants_[i];
+      }
+    }
+
+    // during activation the nodes also signal ready and homed, so the waits below can block
+    if (attention_)
+    {
+      attn_armed_ = true;
+      for (std::size_t pc = 0; pc < chports.size(); pc++)
+      {
+        myMgr->Ports(pc).Adv.Attn.Enable(true);
+      }
+      mnStatusReg activation_mask = attn_mask_;
+      activation_mask.cpm.Ready = 1;
+      activation_mask.cpm.WasHomed = 1;
+      for (std::size_t i = 0; i < handles_.size(); i++)
+      {
+        handles_[i].node->Adv.Attn.Mask.Value(activation_mask);
+        handles_[i].node->Adv.Attn.ClearAttn(activation_mask);
+      }
+    }
 
-      // enable node
+    // enable all nodes at once
+    for (std::size_t i = 0; i < info_.joints.size(); i++)
+    {
+      std::pair<std::size_t, std::size_t> node = nodes[i];
+      sFnd::INode &inode = *handles_[i].node;
+      const NodeInfo & node_info = lookup_node_info(inode);
       RCLCPP_INFO(
         rclcpp::get_logger("TeknicSystemHardware"),
-        "Node[%zu]: type=%d\nuserID: %s\nFW version: %s\nSerial #: %d\nModel: %s\n",
-        node.first, inode.Info.NodeType(), inode.Info.UserID.Value(),
-        inode.Info.FirmwareVersion.Value(), inode.Info.SerialNumber.Value(),
-        inode.Info.Model.Value());
+        "Node[%zu]: type=%d\nuserID: %s\nFW version: %s\nSerial #: %u\nModel: %s\n",
+        node.first, node_info.type, node_info.user_id.c_str(),
+        node_info.firmware.c_str(), node_info.serial, node_info.model.c_str());
+
+      // get encoder counts, derived from the configured conversion so reactivation does not compound it
+      handles_[i].to_counts = counts_conversions_[i] * node_info.resolution;
+      handles_[i].from_counts = 1 / handles_[i].to_counts;
+
       inode.Status.AlertsClear();
       inode.Motion.NodeStopClear();
       inode.EnableReq(true);
-      double timeout = myMgr->TimeStampMsec() + ENABLE_TIMEOUT;	//define a timeout in case the node is unable to enable
-      while (!inode.Motion.IsReady()) {
-        if (myMgr->TimeStampMsec() > timeout) {
-          if (inode.Status.Power.Value().fld.InBusLoss) {
-            RCLCPP_ERROR(
-              rclcpp::get_logger("TeknicSystemHardware"),
-              "Bus Power low");
-            return hardware_interface::CallbackReturn::ERROR;
-          }
+    }
+
+    // wait for the slowest node, then report every node that did not make it
+    std::vector<std::size_t> pending;
+    for (std::size_t i = 0; i < info_.joints.size(); i++)
+    {
+      pending.push_back(i);
+    }
+    mnStatusReg ready_bit;
+    ready_bit.cpm.Ready = 1;
+    wait_for_status(pending, ready_bit, ENABLE_TIMEOUT, "enabled");
+    if (!pending.empty())
+    {
+      for (std::size_t i : pending)
+      {
+        if (handles_[i].node->Status.Power.Value().fld.InBusLoss)
+        {
           RCLCPP_ERROR(
             rclcpp::get_logger("TeknicSystemHardware"),
-            "Timed out waiting for Node %zu to enable", node.first);
-          return hardware_interface::CallbackReturn::ERROR;
+            "Bus Power low on Node %zu (joint %s)", nodes[i].second, info_.joints[i].name.c_str());
+        }
+        else
+        {
+          RCLCPP_ERROR(
+            rclcpp::get_logger("TeknicSystemHardware"),
+            "Timed out waiting for Node %zu (joint %s) to enable",
+            nodes[i].second, info_.joints[i].name.c_str());
         }
       }
-      RCLCPP_INFO(
-        rclcpp::get_logger("TeknicSystemHardware"),
-        "Node %zu enabled", node.first);
-      
-      // homing
-      if (homing_[i] != 0)
+      disarm_attention();
+      return hardware_interface::CallbackReturn::ERROR;
+    }
+
+    // homing, one homing group after another, then the joints without a group one by one
+    std::vector<int> groups;
+    for (int group : homing_groups_)
+    {
+      if (group >= 0 && std::find(groups.begin(), groups.end(), group) == groups.end())
+      {
+        groups.push_back(group);
+      }
+    }
+    std::sort(groups.begin(), groups.end());
+    for (int group : groups)
+    {
+      std::vector<std::size_t> joints;
+      for (std::size_t i = 0; i < info_.joints.size(); i++)
       {
-        if (inode.Motion.Homing.HomingValid())
+        if (homing_groups_[i] == group)
         {
-          if (homing_[i] == 1 && inode.Motion.Homing.WasHomed())
-          {
-            RCLCPP_INFO(
-              rclcpp::get_logger("TeknicSystemHardware"),
-              "Node %zu has already been homed, not homing. Current position is: \t%f",
-              node.first, inode.Motion.PosnMeasured.Value());
-          }
-          else
-          {
-            RCLCPP_INFO(
-              rclcpp::get_logger("TeknicSystemHardware"),
-              "Homing Node %zu now...", node.first);
-            inode.Motion.Homing.Initiate();
-            timeout = myMgr->TimeStampMsec() + HOMING_TIMEOUT;	//define a timeout in case the node is unable to enable
-            while (!inode.Motion.Homing.WasHomed()) {
-              if (myMgr->TimeStampMsec() > timeout) {
-                if (inode.Status.Power.Value().fld.InBusLoss) {
-                  RCLCPP_ERROR(
-                    rclcpp::get_logger("TeknicSystemHardware"),
-                    "Bus Power low");
-                  return hardware_interface::CallbackReturn::ERROR;
-                }
-                RCLCPP_ERROR(
-                  rclcpp::get_logger("TeknicSystemHardware"),
-                  "Node did not complete homing:  \n\t -Ensure Homing settings have been defined through ClearView. \n\t -Check for alerts/Shutdowns \n\t -Ensure timeout is longer than the longest possible homing move");
-                return hardware_interface::CallbackReturn::ERROR;
-              }
-            }
-            RCLCPP_INFO(
-              rclcpp::get_logger("TeknicSystemHardware"),
-              "Node completed homing.");
-          }
-          
-        }
-        else {
-          RCLCPP_INFO(
-            rclcpp::get_logger("TeknicSystemHardware"),
-            "Node[%zu] has not had homing setup through ClearView. The node will not be homed.", node.first);
+          joints.push_back(i);
         }
       }
+      if (!home_joints(joints))
+      {
+        disarm_attention();
+        return hardware_interface::CallbackReturn::ERROR;
+      }
+    }
+    for (std::size_t i = 0; i < info_.joints.size(); i++)
+    {
+      if (homing_groups_[i] < 0 && !home_joints({i}))
+      {
+        disarm_attention();
+        return hardware_interface::CallbackReturn::ERROR;
+      }
+    }
+
+    // back to the runtime mask before the read only nodes are disabled below
+    if (attention_)
+    {
+      for (std::size_t i = 0; i < handles_.size(); i++)
+      {
+        handles_[i].node->Adv.Attn.Mask.Value(attn_mask_);
+      }
+    }
+
+    for (std::size_t i = 0; i < info_.joints.size(); i++)
+    {
+      std::pair<std::size_t, std::size_t> node = nodes[i];
+      sFnd::INode &inode = *handles_[i].node;
 
-      // enable "interrupting moves"
-      inode.Info.Ex.Parameter(98, 1);
+      // enable "interrupting moves", streaming joints queue their moves instead
+      handles_[i].streaming = streaming_[i];
+      inode.Info.Ex.Parameter(98, streaming_[i] ? 0 : 1);
 
-      // get encoder counts
-      counts_conversions_[i] *= inode.Info.PositioningResolution.Value();      
+      // moves of the same trigger group are released together by write()
+      if (handles_[i].trigger_group != 0)
+      {
+        if (!inode.Motion.Adv.Supported())
+        {
+          RCLCPP_ERROR(
+            rclcpp::get_logger("TeknicSystemHardware"),
+            "Node %zu does not support triggered moves, required by sync_write", node.first);
+          disarm_attention();
+          return hardware_interface::CallbackReturn::ERROR;
+        }
+        inode.Motion.Adv.TriggerGroup(handles_[i].trigger_group);
+      }
 
       // set units
       inode.AccUnit(sFnd::INode::COUNTS_PER_SEC2);
 			inode.VelUnit(sFnd::INode::COUNTS_PER_SEC);
 			inode.TrqUnit(sFnd::INode::PCT_MAX);   
 
-      // set limits
-      double vel = std::stod(info_.joints[i].parameters.at("vel_limit"));
-      inode.Motion.VelLimit = vel * counts_conversions_[i];
-      double acc = std::stod(info_.joints[i].parameters.at("acc_limit"));
-      inode.Motion.AccLimit = acc * counts_conversions_[i];
+      // set limits and the other runtime settings configured in the URDF
+      hw_commands_settings_[i] = configured_settings_[i];
+      applied_settings_[i].fill(std::numeric_limits<double>::quiet_NaN());
+      for (std::size_t s = 0; s < SETTING_COUNT; s++)
+      {
+        double value = hw_commands_settings_[i][s];
+        if (!std::isnan(value))
+        {
+          apply_setting(handles_[i], static_cast<setting_t>(s), value);
+          applied_settings_[i][s] = value;
+        }
+      }
 
       double vellim = inode.Motion.VelLimit;
       double accellim = inode.Motion.AccLimit;
@@ -394,7 +1057,54 @@ hardware_interface::CallbackReturn TeknicSystemHardware::on_activate(
         rclcpp::get_logger("TeknicSystemHardware"),
         "Velocity limit of Node %zu set to: %f counts/s^2",
         node.first, vellim);
+
+      // move profile
+      const auto & parameters = info_.joints[i].parameters;
+      handles_[i].profile = move_profiles_[i];
+      if (move_profiles_[i] != TRAPEZOIDAL && !inode.Motion.Adv.Supported())
+      {
+        RCLCPP_ERROR(
+          rclcpp::get_logger("TeknicSystemHardware"),
+          "Node %zu does not support the configured move_profile", node.first);
+        disarm_attention();
+        return hardware_interface::CallbackReturn::ERROR;
+      }
+      if (move_profiles_[i] == ASYMMETRIC)
+      {
+        double dec = std::stod(parameters.at("dec_limit"));
+        inode.Motion.Adv.DecelLimit = dec * handles_[i].to_counts;
+        RCLCPP_INFO(
+          rclcpp::get_logger("TeknicSystemHardware"),
+          "Deceleration limit of Node %zu set to: %f counts/s^2",
+          node.first, inode.Motion.Adv.DecelLimit.Value());
+      }
+      else if (move_profiles_[i] == HEAD_TAIL)
+      {
+        double head_tail_vel = std::stod(parameters.at("head_tail_vel_limit"));
+        inode.Motion.Adv.HeadTailVelLimit = head_tail_vel * handles_[i].to_counts;
+        handles_[i].has_head = parameters.count("head_distance") != 0;
+        handles_[i].has_tail = parameters.count("tail_distance") != 0;
+        if (handles_[i].has_head)
+        {
+          inode.Motion.Adv.HeadDistance = static_cast<unsigned>(
+            std::stod(parameters.at("head_distance")) * handles_[i].to_counts);
+        }
+        if (handles_[i].has_tail)
+        {
+          inode.Motion.Adv.TailDistance = static_cast<unsigned>(
+            std::stod(parameters.at("tail_distance")) * handles_[i].to_counts);
+        }
+        RCLCPP_INFO(
+          rclcpp::get_logger("TeknicSystemHardware"),
+          "Head/tail velocity limit of Node %zu set to: %f counts/s",
+          node.first, inode.Motion.Adv.HeadTailVelLimit.Value());
+      }
       
+      RCLCPP_INFO(
+        rclcpp::get_logger("TeknicSystemHardware"),
+        "Jerk limit of Node %zu is: %u (delay %f ms)",
+        node.first, inode.Motion.JrkLimit.Value(), inode.Motion.JrkLimitDelay.Value());
+
       if (read_only_[i])
       {
         // disable node
@@ -404,33 +1114,76 @@ hardware_interface::CallbackReturn TeknicSystemHardware::on_activate(
         inode.EnableReq(false);
       }
     }
+
+    if (attention_)
+    {
+      // The read only nodes raised NotReady when they were disabled. Once their
+      // status shows it, the attention is on the port and can be flushed.
+      double deadline = myMgr->TimeStampMsec() + ENABLE_TIMEOUT;
+      for (std::size_t i = 0; i < handles_.size(); i++)
+      {
+        sFnd::INode &inode = *handles_[i].node;
+        while (read_only_[i] && myMgr->TimeStampMsec() < deadline)
+        {
+          inode.Status.RT.Refresh();
+          if (!inode.Status.RT.Value().cpm.Ready)
+          {
+            break;
+          }
+          std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(activation_poll_ms_));
+        }
+      }
+      for (std::size_t pc = 0; pc < chports.size(); pc++)
+      {
+        infcNetAttnFlush(myMgr->Ports(pc).NetNumber());
+      }
+      for (std::size_t i = 0; i < handles_.size(); i++)
+      {
+        attn_events_[i] = 0;
+        hw_states_move_done_[i] = 0;
+        hw_states_faults_[i] = 0;
+      }
+    }
   }
   catch(sFnd::mnErr& theErr)
   {
     RCLCPP_ERROR(
       rclcpp::get_logger("TeknicSystemHardware"),
       "Caught error: addr=%d, err=0x%08x\nmsg=%s\n", theErr.TheAddr, theErr.ErrorCode, theErr.ErrorMsg);
+    disarm_attention();
     return hardware_interface::CallbackReturn::ERROR;
   }
 
+  if (attention_)
+  {
+    start_attn_workers();
+  }
+  start_port_workers();
+  if (async_write_)
+  {
+    start_command_workers();
+  }
+  save_node_info();
+
   return hardware_interface::CallbackReturn::SUCCESS;
 }
 
 hardware_interface::CallbackReturn TeknicSystemHardware::on_deactivate(
   const rclcpp_lifecycle::State & /*previous_state*/)
 {
+  stop_command_workers();
+  stop_port_workers();
+  stop_attn_workers();
+
   try
   {
-    for (std::size_t i = 0; i < info_.joints.size(); i++)
+    for (std::size_t i = 0; i < handles_.size(); i++)
     {
-      std::pair<std::size_t, std::size_t> node = nodes[i];
-      sFnd::INode &inode = myMgr->Ports(node.first).Nodes(node.second);
-
       // disable node
       RCLCPP_INFO(
         rclcpp::get_logger("TeknicSystemHardware"),
-        "Disabling Node %zu", node.first);
-      inode.EnableReq(false);
+        "Disabling Node %zu", nodes[i].first);
+      handles_[i].node->EnableReq(false);
     }
   }
   catch(sFnd::mnErr& theErr)
@@ -443,114 +1196,1484 @@ hardware_interface::CallbackReturn TeknicSystemHardware::on_deactivate(
   return hardware_interface::CallbackReturn::SUCCESS;
 }
 
-hardware_interface::return_type TeknicSystemHardware::read(
-  const rclcpp::Time & /*time*/, const rclcpp::Duration & /*period*/)
+void TeknicSystemHardware::wait_for_status(
+  std::vector<std::size_t> & joints, mnStatusReg bits, double timeout_ms, const char * what)
 {
-  try
+  double deadline = myMgr->TimeStampMsec() + timeout_ms;
+  while (true)
   {
-    for (std::size_t i = 0; i < info_.joints.size(); i++)
+    for (auto it = joints.begin(); it != joints.end(); )
     {
-      std::pair<std::size_t, std::size_t> node = nodes[i];
-      sFnd::INode &inode = myMgr->Ports(node.first).Nodes(node.second);
-      inode.Motion.PosnMeasured.Refresh();
-      hw_states_positions_[i] = inode.Motion.PosnMeasured.Value() / counts_conversions_[i];
-      inode.Motion.VelMeasured.Refresh();
-      hw_states_velocities_[i] = inode.Motion.VelMeasured.Value() / counts_conversions_[i];
-      if (peak_torques_[i] != 0)
-      {
-        inode.Motion.TrqMeasured.Refresh();
-        double torque = inode.Motion.TrqMeasured.Value() / 100 * peak_torques_[i];
-        if (feed_constants_[i] != 0)
-        {
-          hw_states_efforts_[i] = torque * 2 * M_PI / feed_constants_[i];
-        }
-        else
-        {
-          hw_states_efforts_[i] = torque;
-        }
-      }
-
-      if (read_only_[i])
+      sFnd::INode &inode = *handles_[*it].node;
+      inode.Status.RT.Refresh();
+      if ((inode.Status.RT.Value().attnBits & bits.attnBits) == bits.attnBits)
       {
-        // RCLCPP_INFO(
-        //   rclcpp::get_logger("TeknicSystemHardware"),
-        //   "pos: %f, vel: %f, torque: %f",
-        //   hw_states_positions_[i], hw_states_velocities_[i], hw_states_efforts_[i]);
         RCLCPP_INFO(
           rclcpp::get_logger("TeknicSystemHardware"),
-          "Joint %lu: pos: %f",
-          i, hw_states_positions_[i]);
+          "Node %zu (joint %s) %s", nodes[*it].second, info_.joints[*it].name.c_str(), what);
+        it = joints.erase(it);
+      }
+      else
+      {
+        ++it;
       }
     }
+    double remaining = deadline - myMgr->TimeStampMsec();
+    if (joints.empty() || remaining <= 0)
+    {
+      return;
+    }
+
+    // block instead of spinning, the status of all nodes is checked again after every wakeup
+    if (attention_)
+    {
+      // attentions of the other nodes are latched and seen on the next pass
+      handles_[joints.front()].node->Adv.Attn.WaitForAttn(
+        bits, static_cast<std::int32_t>(remaining), true);
+    }
+    else
+    {
+      std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(
+        std::min(remaining, activation_poll_ms_)));
+    }
   }
-  catch(sFnd::mnErr& theErr)
+}
+
+const TeknicSystemHardware::NodeInfo & TeknicSystemHardware::lookup_node_info(
+  sFnd::INode & inode)
+{
+  // the serial number identifies the node, a swapped motor gets a fresh entry
+  std::uint32_t serial = inode.Info.SerialNumber.Value();
+  auto it = node_info_.find(serial);
+  if (it != node_info_.end())
   {
-    RCLCPP_ERROR(
-      rclcpp::get_logger("TeknicSystemHardware"),
-      "Caught error: addr=%d, err=0x%08x\nmsg=%s\n", theErr.TheAddr, theErr.ErrorCode, theErr.ErrorMsg);
-    return hardware_interface::return_type::ERROR;
+    return it->second;
   }
 
-  return hardware_interface::return_type::OK;
+  NodeInfo info;
+  info.serial = serial;
+  info.type = inode.Info.NodeType();
+  info.user_id = inode.Info.UserID.Value();
+  info.firmware = inode.Info.FirmwareVersion.Value();
+  info.model = inode.Info.Model.Value();
+  info.resolution = inode.Info.PositioningResolution.Value();
+  node_info_dirty_ = true;
+  return node_info_.emplace(serial, info).first->second;
 }
 
-hardware_interface::return_type TeknicSystemHardware::write(
-  const rclcpp::Time & /*time*/, const rclcpp::Duration & /*period*/)
+// one node per line: serial, resolution, type, firmware, model and user id separated by tabs
+void TeknicSystemHardware::load_node_info()
 {
-  try
+  std::ifstream file(node_info_file_);
+  std::string line;
+  std::size_t number = 0;
+  while (std::getline(file, line))
   {
-    for (std::size_t i = 0; i < info_.joints.size(); i++)
+    number++;
+    std::istringstream fields(line);
+    std::string serial, resolution, type;
+    NodeInfo info;
+    if (std::getline(fields, serial, '\t') && std::getline(fields, resolution, '\t') &&
+      std::getline(fields, type, '\t') && std::getline(fields, info.firmware, '\t') &&
+      std::getline(fields, info.model, '\t') && std::getline(fields, info.user_id))
     {
-      if (!read_only_[i])
+      // a broken line only costs the cached entry, the node is queried again
+      try
       {
-        std::pair<std::size_t, std::size_t> node = nodes[i];
-        sFnd::INode &inode = myMgr->Ports(node.first).Nodes(node.second);
-        switch (control_mode_[i])
-        {
-          case UNDEFINED:
-          {
-            // RCLCPP_INFO(
-            //   rclcpp::get_logger("TeknicSystemHardware"),
-            //   "Nothing is using the hardware interface!");
-            break;
-          }
-          case SPEED_LOOP:
-          {
-            if (!std::isnan(hw_commands_velocities_[i]))
-            {
-              double target = hw_commands_velocities_[i] * counts_conversions_[i];
-              // RCLCPP_INFO(
-              //   rclcpp::get_logger("TeknicSystemHardware"),
-              //   "target vel: %i", target);
-              inode.Motion.MoveVelStart(target);
-            }
-            break;
-          }
-          case POSITION_LOOP:
-          {
-            if (!std::isnan(hw_commands_positions_[i]))
-            {
-              double target = hw_commands_positions_[i] * counts_conversions_[i];
-              // RCLCPP_INFO(
-              //   rclcpp::get_logger("TeknicSystemHardware"),
-              //   "target pos: %i", target);
-              inode.Motion.MovePosnStart(target, true);
-            }
-            break;
-          }
-        }
+        info.serial = std::stoul(serial);
+        info.resolution = std::stoul(resolution);
+        info.type = std::stoi(type);
+      }
+      catch(std::exception &)
+      {
+        RCLCPP_WARN(
+          rclcpp::get_logger("TeknicSystemHardware"),
+          "Skipping malformed line %zu of %s", number, node_info_file_.c_str());
+        continue;
       }
+      node_info_[info.serial] = info;
     }
   }
-  catch(sFnd::mnErr& theErr)
+}
+
+void TeknicSystemHardware::save_node_info()
+{
+  if (node_info_file_.empty() || !node_info_dirty_)
   {
-    RCLCPP_ERROR(
+    return;
+  }
+  std::ofstream file(node_info_file_);
+  for (const auto & entry : node_info_)
+  {
+    const NodeInfo & info = entry.second;
+    file << info.serial << '\t' << info.resolution << '\t' << info.type << '\t' <<
+      info.firmware << '\t' << info.model << '\t' << info.user_id << '\n';
+  }
+  if (!file)
+  {
+    RCLCPP_WARN(
       rclcpp::get_logger("TeknicSystemHardware"),
-      "Caught error: addr=%d, err=0x%08x\nmsg=%s\n", theErr.TheAddr, theErr.ErrorCode, theErr.ErrorMsg);
-    return hardware_interface::return_type::ERROR;
+      "Could not write node info cache %s", node_info_file_.c_str());
+    return;
   }
+  node_info_dirty_ = false;
+}
 
-  return hardware_interface::return_type::OK;
+bool TeknicSystemHardware::home_joints(const std::vector<std::size_t> & joints)
+{
+  // start homing on all nodes of the group
+  std::vector<std::size_t> homing;
+  for (std::size_t i : joints)
+  {
+    sFnd::INode &inode = *handles_[i].node;
+    if (homing_[i] == 0)
+    {
+      continue;
+    }
+    if (!inode.Motion.Homing.HomingValid())
+    {
+      RCLCPP_INFO(
+        rclcpp::get_logger("TeknicSystemHardware"),
+        "Node[%zu] has not had homing setup through ClearView. The node will not be homed.", nodes[i].first);
+      continue;
+    }
+    if (homing_[i] == 1 && inode.Motion.Homing.WasHomed())
+    {
+      RCLCPP_INFO(
+        rclcpp::get_logger("TeknicSystemHardware"),
+        "Node %zu has already been homed, not homing. Current position is: \t%f",
+        nodes[i].first, inode.Motion.PosnMeasured.Value());
+      continue;
+    }
+    RCLCPP_INFO(
+      rclcpp::get_logger("TeknicSystemHardware"),
+      "Homing Node %zu (joint %s) now...", nodes[i].first, info_.joints[i].name.c_str());
+    if (attention_)
+    {
+      mnStatusReg homed_bit;
+      homed_bit.cpm.WasHomed = 1;
+      inode.Adv.Attn.ClearAttn(homed_bit);
+    }
+    inode.Motion.Homing.Initiate();
+    homing.push_back(i);
+  }
+
+  // wait for the slowest node of the group
+  mnStatusReg homed_bit;
+  homed_bit.cpm.WasHomed = 1;
+  wait_for_status(homing, homed_bit, HOMING_TIMEOUT, "completed homing");
+
+  for (std::size_t i : homing)
+  {
+    if (handles_[i].node->Status.Power.Value().fld.InBusLoss)
+    {
+      RCLCPP_ERROR(
+        rclcpp::get_logger("TeknicSystemHardware"),
+        "Bus Power low on Node %zu (joint %s)", nodes[i].first, info_.joints[i].name.c_str());
+    }
+    else
+    {
+      RCLCPP_ERROR(
+        rclcpp::get_logger("TeknicSystemHardware"),
+        "Node %zu (joint %s) did not complete homing:  \n\t -Ensure Homing settings have been defined through ClearView. \n\t -Check for alerts/Shutdowns \n\t -Ensure timeout is longer than the longest possible homing move",
+        nodes[i].first, info_.joints[i].name.c_str());
+    }
+  }
+  return homing.empty();
+}
+
+void TeknicSystemHardware::start_port_workers()
+{
+  for (VelocityEstimator & estimator : velocity_estimators_)
+  {
+    estimator.initialized = false;
+  }
+  for (std::size_t pc = 0; pc < chports.size(); pc++)
+  {
+    auto worker = std::make_unique<PortWorker>();
+    worker->port = pc;
+    for (std::size_t i = 0; i < info_.joints.size(); i++)
+    {
+      if (nodes[i].first == pc)
+      {
+        worker->joints.emplace_back(i);
+      }
+    }
+    for (auto & slot : worker->buffer.slots)
+    {
+      slot.resize(worker->joints.size());
+    }
+    worker->working.resize(worker->joints.size());
+    if (pipelined_read_)
+    {
+      // Only the positions are read raw, they are in counts either way. The raw
+      // formats of the measured velocity and torque are not documented, these
+      // keep going through sFoundation.
+      for (std::size_t k = 0; k < worker->joints.size(); k++)
+      {
+        std::size_t i = worker->joints[k];
+        const ReadSet & read_set = read_sets_[i];
+        if (read_set.position || read_set.estimate_velocity)
+        {
+          worker->requests.push_back(
+            {k, static_cast<nodeaddr>(NODE_ADDR(handles_[i].node->Info.Ex.Addr())), CPM_P_POSN_MEAS});
+        }
+      }
+      worker->responses.resize(worker->requests.size());
+      // only ever raise the limit, the burst is windowed to whatever it ends up at
+      nodeulong limit = std::min<nodeulong>(worker->requests.size(), CMD_QUEUE_MAX);
+      worker->queue_limit = CMD_QUEUE_DEFAULT;
+      if (limit > CMD_QUEUE_DEFAULT)
+      {
+        cnErrCode code = infcSetCmdQueueLimit(myMgr->Ports(pc).NetNumber(), limit);
+        if (code == MN_OK)
+        {
+          worker->queue_limit = limit;
+        }
+        else
+        {
+          RCLCPP_WARN(
+            rclcpp::get_logger("TeknicSystemHardware"),
+            "Could not raise the command queue limit of port %zu: err=0x%08x", pc, code);
+        }
+      }
+    }
+    port_workers_.emplace_back(std::move(worker));
+  }
+  for (auto & worker : port_workers_)
+  {
+    worker->thread = std::thread(&TeknicSystemHardware::port_worker_loop, this, std::ref(*worker));
+  }
+
+  if (background_read_)
+  {
+    // don't hand out NaN states, wait for the first complete snapshot
+    for (auto & worker : port_workers_)
+    {
+      std::unique_lock<std::mutex> lock(worker->mutex);
+      worker->cv.wait(lock, [&worker] {return worker->completed != 0 || worker->failed;});
+    }
+  }
+  for (auto & worker : port_workers_)
+  {
+    worker->last_update = steady_seconds();
+  }
+}
+
+void TeknicSystemHardware::stop_port_workers()
+{
+  for (auto & worker : port_workers_)
+  {
+    {
+      std::lock_guard<std::mutex> lock(worker->mutex);
+      worker->stop = true;
+    }
+    worker->cv.notify_all();
+  }
+  for (auto & worker : port_workers_)
+  {
+    if (worker->thread.joinable())
+    {
+      worker->thread.join();
+    }
+    if (worker->queue_limit > CMD_QUEUE_DEFAULT)
+    {
+      cnErrCode code = infcSetCmdQueueLimit(
+        myMgr->Ports(worker->port).NetNumber(), CMD_QUEUE_DEFAULT);
+      if (code != MN_OK)
+      {
+        RCLCPP_ERROR(
+          rclcpp::get_logger("TeknicSystemHardware"),
+          "Could not restore the command queue limit of port %zu: err=0x%08x", worker->port, code);
+      }
+    }
+  }
+  port_workers_.clear();
+}
+
+void TeknicSystemHardware::start_command_workers()
+{
+  for (std::size_t pc = 0; pc < chports.size(); pc++)
+  {
+    auto worker = std::make_unique<CommandWorker>();
+    worker->port = pc;
+    for (std::size_t i = 0; i < info_.joints.size(); i++)
+    {
+      if (nodes[i].first == pc && !handles_[i].read_only)
+      {
+        worker->joints.emplace_back(i);
+      }
+    }
+    if (worker->joints.empty())
+    {
+      continue;
+    }
+    for (auto & slot : worker->buffer.slots)
+    {
+      slot.resize(worker->joints.size());
+    }
+    worker->sent.resize(worker->joints.size(), 0);
+    worker->splines.resize(worker->joints.size());
+    for (std::size_t k = 0; k < worker->joints.size(); k++)
+    {
+      worker->splines[k].enabled = interpolated_[worker->joints[k]];
+      worker->interpolating = worker->interpolating || worker->splines[k].enabled;
+    }
+    worker->settings_sent.resize(worker->joints.size(), 0);
+    worker->triggers.reserve(worker->joints.size());
+    command_workers_.emplace_back(std::move(worker));
+  }
+  for (auto & worker : command_workers_)
+  {
+    worker->thread = std::thread(
+      &TeknicSystemHardware::command_worker_loop, this, std::ref(*worker));
+  }
+}
+
+void TeknicSystemHardware::stop_command_workers()
+{
+  for (auto & worker : command_workers_)
+  {
+    {
+      std::lock_guard<std::mutex> lock(worker->mutex);
+      worker->stop = true;
+    }
+    worker->cv.notify_all();
+  }
+  for (auto & worker : command_workers_)
+  {
+    if (worker->thread.joinable())
+    {
+      worker->thread.join();
+    }
+  }
+  command_workers_.clear();
+}
+
+void TeknicSystemHardware::command_worker_loop(CommandWorker & worker)
+{
+  auto tick = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+    std::chrono::duration<double>(interpolation_period_));
+  auto next_tick = std::chrono::steady_clock::now() + tick;
+  while (true)
+  {
+    {
+      std::unique_lock<std::mutex> lock(worker.mutex);
+      auto ready = [&worker] {
+          return worker.stop || worker.buffer.fresh();
+        };
+      if (worker.interpolating)
+      {
+        worker.cv.wait_until(lock, next_tick, ready);
+      }
+      else
+      {
+        worker.cv.wait(lock, ready);
+      }
+      if (worker.stop)
+      {
+        return;
+      }
+    }
+    bool fresh = worker.buffer.consume();
+
+    // only the newest command set is sent, older ones are covered by the sequence numbers
+    const std::vector<QueuedCommand> & commands = worker.buffer.front();
+    worker.triggers.clear();
+    try
+    {
+      for (std::size_t k = 0; fresh && k < worker.joints.size(); k++)
+      {
+        const QueuedCommand & command = commands[k];
+        const JointHandle & handle = handles_[worker.joints[k]];
+        if (command.settings_seq != worker.settings_sent[k])
+        {
+          for (std::size_t s = 0; s < SETTING_COUNT; s++)
+          {
+            if (!std::isnan(command.settings[s]))
+            {
+              apply_setting(handle, static_cast<setting_t>(s), command.settings[s]);
+            }
+          }
+          worker.settings_sent[k] = command.settings_seq;
+        }
+        if (command.seq == worker.sent[k])
+        {
+          continue;
+        }
+        worker.sent[k] = command.seq;
+        if (worker.splines[k].enabled && command.mode == POSITION_LOOP)
+        {
+          interpolate_command(worker, k, command);
+          continue;
+        }
+        // any other command ends the interpolation
+        worker.splines[k].active = false;
+        worker.splines[k].last_arrival = std::numeric_limits<double>::quiet_NaN();
+        double start = steady_seconds();
+        start_move(handle, command.mode, command.target);
+        measure_transaction(worker.port, steady_seconds() - start);
+        if (handle.trigger_group != 0 &&
+          std::find(worker.triggers.begin(), worker.triggers.end(), handle.trigger_group) ==
+          worker.triggers.end())
+        {
+          worker.triggers.push_back(handle.trigger_group);
+        }
+      }
+      if (worker.interpolating && std::chrono::steady_clock::now() >= next_tick)
+      {
+        // skip missed ticks instead of sending a burst
+        next_tick = std::max(next_tick + tick, std::chrono::steady_clock::now());
+        interpolate_tick(worker);
+      }
+      for (std::size_t group : worker.triggers)
+      {
+        myMgr->Ports(worker.port).Adv.TriggerMovesInGroup(group);
+      }
+    }
+    catch(sFnd::mnErr& theErr)
+    {
+      // handed over under the mutex like the read workers do, write() reads it there
+      {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.error = theErr;
+      }
+      worker.failed = true;
+    }
+  }
+}
+
+void TeknicSystemHardware::interpolate_command(
+  CommandWorker & worker, std::size_t k, const QueuedCommand & command)
+{
+  Spline & spline = worker.splines[k];
+  double now = steady_seconds();
+  double interval = now - spline.last_arrival;
+
+  // the first command after a pause has no rate to follow, it starts from rest
+  double p0 = spline.last_target;
+  double v0 = 0;
+  if (spline.active)
+  {
+    spline.sample(now, p0, v0);
+    if (now > spline.t0 + 2 * spline.duration)
+    {
+      v0 = 0;
+    }
+  }
+  if (std::isnan(interval) || interval <= 0 || interval > 0.5 || std::isnan(p0))
+  {
+    spline.active = false;
+    spline.settled = false;
+    spline.p1 = command.target;
+    spline.v1 = 0;
+  }
+  else
+  {
+    spline.active = true;
+    spline.settled = false;
+    spline.t0 = now;
+    spline.duration = interval;
+    spline.p0 = p0;
+    spline.v0 = v0;
+    spline.p1 = command.target;
+    spline.v1 = (command.target - spline.last_target) / interval;
+  }
+  spline.last_arrival = now;
+  spline.last_target = command.target;
+}
+
+void TeknicSystemHardware::interpolate_tick(CommandWorker & worker)
+{
+  double now = steady_seconds();
+  for (std::size_t k = 0; k < worker.joints.size(); k++)
+  {
+    Spline & spline = worker.splines[k];
+    if (!spline.enabled || spline.settled)
+    {
+      continue;
+    }
+    double position = spline.p1;
+    double velocity = 0;
+    if (spline.active)
+    {
+      spline.sample(now, position, velocity);
+    }
+    // the end of a segment is sent once, then the joint holds until the next command
+    spline.settled = !spline.active || now >= spline.t0 + spline.duration;
+
+    const JointHandle & handle = handles_[worker.joints[k]];
+    double start = steady_seconds();
+    start_move(handle, POSITION_LOOP, position);
+    measure_transaction(worker.port, steady_seconds() - start);
+    if (handle.trigger_group != 0 &&
+      std::find(worker.triggers.begin(), worker.triggers.end(), handle.trigger_group) ==
+      worker.triggers.end())
+    {
+      worker.triggers.push_back(handle.trigger_group);
+    }
+  }
+}
+
+void TeknicSystemHardware::Spline::sample(double t, double & p, double & v) const
+{
+  double s = std::min(std::max((t - t0) / duration, 0.0), 1.0);
+  double s2 = s * s;
+  double s3 = s2 * s;
+  p = (2 * s3 - 3 * s2 + 1) * p0 + (s3 - 2 * s2 + s) * duration * v0 +
+    (-2 * s3 + 3 * s2) * p1 + (s3 - s2) * duration * v1;
+  v = ((6 * s2 - 6 * s) * p0 + (-6 * s2 + 6 * s) * p1) / duration +
+    (3 * s2 - 4 * s + 1) * v0 + (3 * s2 - 2 * s) * v1;
+}
+
+void TeknicSystemHardware::port_worker_loop(PortWorker & worker)
+{
+  std::unique_lock<std::mutex> lock(worker.mutex);
+  while (true)
+  {
+    if (!background_read_)
+    {
+      worker.cv.wait(lock, [&worker] {return worker.stop || worker.requested != worker.completed;});
+    }
+    if (worker.stop)
+    {
+      return;
+    }
+    // a request that arrives while refreshing is served by the next pass
+    std::uint64_t serving = worker.requested;
+    lock.unlock();
+
+    // every worker only touches the samples of its own joints
+    std::vector<JointSample> & samples = worker.working;
+    bool failed = false;
+    try
+    {
+      if (!worker.requests.empty())
+      {
+        refresh_port_pipelined(worker, samples);
+      }
+      else
+      {
+        for (std::size_t k = 0; k < worker.joints.size(); k++)
+        {
+          // offset the slot by the joint so decimated signals are spread over the cycles
+          refresh_joint(worker.joints[k], samples[k], worker.cycle + k);
+        }
+      }
+      worker.cycle++;
+    }
+    catch(sFnd::mnErr& theErr)
+    {
+      failed = true;
+      lock.lock();
+      worker.error = theErr;
+      lock.unlock();
+      worker.failed = true;
+    }
+    if (!failed)
+    {
+      worker.buffer.back() = worker.working;
+      worker.buffer.publish();
+    }
+
+    lock.lock();
+    worker.completed = background_read_ ? worker.completed + 1 : serving;
+    worker.cv.notify_all();
+    if (failed && background_read_)
+    {
+      // don't hammer a broken link
+      worker.cv.wait_for(lock, std::chrono::milliseconds(10), [&worker] {return worker.stop;});
+    }
+  }
+}
+
+void TeknicSystemHardware::start_attn_workers()
+{
+  attn_stop_ = false;
+  for (std::size_t pc = 0; pc < chports.size(); pc++)
+  {
+    auto worker = std::make_unique<AttnWorker>();
+    worker->port = pc;
+    worker->joints.fill(info_.joints.size());
+    for (std::size_t i = 0; i < handles_.size(); i++)
+    {
+      if (nodes[i].first == pc)
+      {
+        worker->joints[NODE_ADDR(handles_[i].node->Info.Ex.Addr())] = i;
+      }
+    }
+    worker->thread = std::thread(&TeknicSystemHardware::attn_worker_loop, this, std::ref(*worker));
+    attn_workers_.emplace_back(std::move(worker));
+  }
+}
+
+void TeknicSystemHardware::stop_attn_workers()
+{
+  attn_stop_ = true;
+  // disabling the posting releases a pending WaitForAttn
+  disarm_attention();
+  for (auto & worker : attn_workers_)
+  {
+    if (worker->thread.joinable())
+    {
+      worker->thread.join();
+    }
+  }
+  attn_workers_.clear();
+}
+
+void TeknicSystemHardware::disarm_attention()
+{
+  if (!attn_armed_)
+  {
+    return;
+  }
+  attn_armed_ = false;
+  // the nodes must stop generating attentions before the ports stop posting them
+  mnStatusReg none;
+  for (const JointHandle & handle : handles_)
+  {
+    try
+    {
+      handle.node->Adv.Attn.Mask.Value(none);
+    }
+    catch(sFnd::mnErr& theErr)
+    {
+      RCLCPP_ERROR(
+        rclcpp::get_logger("TeknicSystemHardware"),
+        "Caught error: addr=%d, err=0x%08x\nmsg=%s\n", theErr.TheAddr, theErr.ErrorCode, theErr.ErrorMsg);
+    }
+  }
+  for (std::size_t pc = 0; pc < chports.size(); pc++)
+  {
+    try
+    {
+      myMgr->Ports(pc).Adv.Attn.Enable(false);
+    }
+    catch(sFnd::mnErr& theErr)
+    {
+      RCLCPP_ERROR(
+        rclcpp::get_logger("TeknicSystemHardware"),
+        "Caught error: addr=%d, err=0x%08x\nmsg=%s\n", theErr.TheAddr, theErr.ErrorCode, theErr.ErrorMsg);
+    }
+  }
+}
+
+void TeknicSystemHardware::attn_worker_loop(AttnWorker & worker)
+{
+  sFnd::IAttnPort & attn = myMgr->Ports(worker.port).Adv.Attn;
+  while (!attn_stop_)
+  {
+    mnAttnReqReg received;
+    sFnd::IAttnPort::attnState state = attn.WaitForAttn(received);
+    if (state == sFnd::IAttnPort::HAS_ATTN)
+    {
+      std::size_t i = worker.joints[NODE_ADDR(received.MultiAddr)];
+      if (i < attn_events_.size())
+      {
+        attn_events_[i].fetch_or(received.AttentionReg.attnBits);
+      }
+    }
+    else if (state != sFnd::IAttnPort::TIMEOUT)
+    {
+      // disabled or terminating
+      return;
+    }
+  }
+}
+
+void TeknicSystemHardware::refresh_joint(std::size_t i, JointSample & sample, std::uint64_t slot)
+{
+  const ReadSet & read_set = read_sets_[i];
+  const JointHandle & handle = handles_[i];
+  sFnd::INode &inode = *handle.node;
+  if (read_set.position || read_set.estimate_velocity)
+  {
+    inode.Motion.PosnMeasured.Refresh();
+    sample.stamp = steady_seconds();
+    sample.position = inode.Motion.PosnMeasured.Value() * handle.from_counts;
+    if (read_set.estimate_velocity)
+    {
+      sample.velocity = velocity_estimators_[i].update(sample.position, sample.stamp);
+    }
+  }
+  refresh_rates(i, sample, slot);
+}
+
+void TeknicSystemHardware::refresh_rates(std::size_t i, JointSample & sample, std::uint64_t slot)
+{
+  const ReadSet & read_set = read_sets_[i];
+  const JointHandle & handle = handles_[i];
+  sFnd::INode &inode = *handle.node;
+  if (read_set.velocity && !read_set.estimate_velocity && slot % read_set.velocity_decimation == 0)
+  {
+    inode.Motion.VelMeasured.Refresh();
+    sample.velocity = inode.Motion.VelMeasured.Value() * handle.from_counts;
+  }
+  if (read_set.effort && (slot + 1) % read_set.effort_decimation == 0)
+  {
+    inode.Motion.TrqMeasured.Refresh();
+    sample.effort = inode.Motion.TrqMeasured.Value() * handle.effort_scale;
+  }
+}
+
+double TeknicSystemHardware::VelocityEstimator::update(
+  double measured_position, double measured_stamp)
+{
+  if (!initialized)
+  {
+    initialized = true;
+    position = measured_position;
+    velocity = 0;
+    stamp = measured_stamp;
+    return velocity;
+  }
+  double dt = measured_stamp - stamp;
+  if (dt <= 0)
+  {
+    return velocity;
+  }
+  stamp = measured_stamp;
+  switch (filter)
+  {
+    case FINITE_DIFFERENCE:
+      velocity = (measured_position - position) / dt;
+      position = measured_position;
+      break;
+    case ALPHA_BETA:
+    {
+      double predicted = position + velocity * dt;
+      double residual = measured_position - predicted;
+      position = predicted + alpha * residual;
+      velocity += beta * residual / dt;
+      break;
+    }
+  }
+  return velocity;
+}
+
+void TeknicSystemHardware::exchange_raw(
+  std::size_t port, const std::vector<RawRequest> & requests, std::size_t window,
+  std::vector<std::int64_t> & responses)
+{
+  netaddr net = myMgr->Ports(port).NetNumber();
+  sFnd::mnErr err;
+  err.TheAddr = MULTI_ADDR(net, 0);
+  err.ErrorCode = MN_OK;
+
+  // keep up to window requests on the link, the responses arrive in request order
+  std::size_t sent = 0;
+  std::size_t received = 0;
+  while (received < sent || (sent < requests.size() && err.ErrorCode == MN_OK))
+  {
+    if (sent < requests.size() && sent - received < window && err.ErrorCode == MN_OK)
+    {
+      const RawRequest & request = requests[sent];
+      packetbuf cmd;
+      cmd.Fld.SetupHdr(MN_PKT_TYPE_CMD, request.addr);
+      if (request.param < 256)
+      {
+        cmd.Byte.Buffer[CMD_LOC] = MN_CMD_GET_PARAM0;
+        cmd.Byte.Buffer[CMD_LOC + 1] = static_cast<nodechar>(request.param);
+      }
+      else
+      {
+        cmd.Byte.Buffer[CMD_LOC] = MN_CMD_GET_PARAM1;
+        cmd.Byte.Buffer[CMD_LOC + 1] = static_cast<nodechar>(request.param - 256);
+      }
+      cmd.Fld.PktLen = 2;
+      cmd.Byte.BufferSize = MN_API_PACKET_HDR_LEN + 2;
+      err.ErrorCode = infcSendCommand(net, &cmd);
+      if (err.ErrorCode != MN_OK)
+      {
+        err.TheAddr = MULTI_ADDR(net, request.addr);
+        continue;
+      }
+      sent++;
+      continue;
+    }
+
+    // drain every outstanding response, even after an error
+    const RawRequest & request = requests[received++];
+    packetbuf resp;
+    cnErrCode code = infcGetResponse(net, &resp);
+    if (err.ErrorCode != MN_OK)
+    {
+      continue;
+    }
+    if (code != MN_OK || resp.Fld.PktType != MN_PKT_TYPE_RESP || resp.Fld.Addr != request.addr)
+    {
+      err.ErrorCode = code != MN_OK ? code : MN_ERR_RESP_FMT;
+      err.TheAddr = MULTI_ADDR(net, request.addr);
+      continue;
+    }
+    // little endian payload, sign extended to the received width
+    std::size_t len = std::min<std::size_t>(resp.Fld.PktLen, sizeof(std::int64_t));
+    std::uint64_t value = 0;
+    for (std::size_t b = 0; b < len; b++)
+    {
+      value |= static_cast<std::uint64_t>(resp.Byte.Buffer[RESP_LOC + b]) << (8 * b);
+    }
+    if (len > 0 && len < sizeof(std::int64_t) && (value >> (8 * len - 1)) & 1)
+    {
+      value |= ~std::uint64_t(0) << (8 * len);
+    }
+    responses[received - 1] = static_cast<std::int64_t>(value);
+  }
+
+  if (err.ErrorCode != MN_OK)
+  {
+    snprintf(
+      err.ErrorMsg, sizeof(err.ErrorMsg),
+      "Pipelined parameter read failed on port %u", static_cast<unsigned>(net));
+    throw err;
+  }
+}
+
+void TeknicSystemHardware::refresh_port_pipelined(
+  PortWorker & worker, std::vector<JointSample> & samples)
+{
+  double start = steady_seconds();
+  exchange_raw(worker.port, worker.requests, worker.queue_limit, worker.responses);
+  // all positions of the burst are stamped with the middle of the exchange
+  double stamp = (start + steady_seconds()) / 2;
+  for (std::size_t r = 0; r < worker.requests.size(); r++)
+  {
+    std::size_t k = worker.requests[r].joint;
+    std::size_t i = worker.joints[k];
+    // measured position is in counts, same as through sFoundation
+    samples[k].stamp = stamp;
+    samples[k].position = worker.responses[r] * handles_[i].from_counts;
+    if (read_sets_[i].estimate_velocity)
+    {
+      samples[k].velocity = velocity_estimators_[i].update(samples[k].position, stamp);
+    }
+  }
+  for (std::size_t k = 0; k < worker.joints.size(); k++)
+  {
+    refresh_rates(worker.joints[k], samples[k], worker.cycle + k);
+  }
+}
+
+hardware_interface::return_type TeknicSystemHardware::read(
+  const rclcpp::Time & /*time*/, const rclcpp::Duration & /*period*/)
+{
+  bool deadline = read_deadline_.count() > 0;
+  if (!background_read_)
+  {
+    // kick off all ports at once, then wait for the slowest one
+    for (auto & worker : port_workers_)
+    {
+      {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        worker->requested++;
+      }
+      worker->cv.notify_all();
+    }
+    auto until = std::chrono::steady_clock::now() +
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(read_deadline_);
+    for (auto & worker : port_workers_)
+    {
+      std::unique_lock<std::mutex> lock(worker->mutex);
+      auto done = [&worker] {return worker->completed == worker->requested;};
+      if (deadline)
+      {
+        worker->cv.wait_until(lock, until, done);
+      }
+      else
+      {
+        worker->cv.wait(lock, done);
+      }
+    }
+  }
+
+  bool failed = false;
+  double now = steady_seconds();
+  for (auto & worker : port_workers_)
+  {
+    bool fresh = false;
+    bool errored = worker->failed.exchange(false);
+    if (errored)
+    {
+      // with a deadline a failed pass is just a miss, the run is logged once below
+      if (!deadline || worker->consecutive_misses == 0)
+      {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        RCLCPP_ERROR(
+          rclcpp::get_logger("TeknicSystemHardware"),
+          "Caught error: addr=%d, err=0x%08x\nmsg=%s\n",
+          worker->error.TheAddr, worker->error.ErrorCode, worker->error.ErrorMsg);
+      }
+      failed = failed || !deadline;
+    }
+    else if (worker->buffer.consume())
+    {
+      const std::vector<JointSample> & samples = worker->buffer.front();
+      for (std::size_t k = 0; k < worker->joints.size(); k++)
+      {
+        latest_samples_[worker->joints[k]] = samples[k];
+      }
+      fresh = true;
+    }
+
+    if (!deadline)
+    {
+      continue;
+    }
+    // in background mode a port is late if it published nothing for a whole deadline,
+    // a failed pass always counts as a miss and keeps the last samples of the port
+    if (!errored &&
+      (fresh || (background_read_ && now - worker->last_update <= read_deadline_.count())))
+    {
+      if (fresh)
+      {
+        worker->last_update = now;
+      }
+      if (worker->consecutive_misses > 0)
+      {
+        RCLCPP_INFO(
+          rclcpp::get_logger("TeknicSystemHardware"),
+          "Port %zu is back after %u missed read deadlines (%lu total)",
+          worker->port, worker->consecutive_misses, worker->total_misses);
+      }
+      worker->consecutive_misses = 0;
+    }
+    else
+    {
+      worker->consecutive_misses++;
+      worker->total_misses++;
+      // only the start and the end of a run of misses are logged, not every cycle
+      if (worker->consecutive_misses == 1)
+      {
+        RCLCPP_WARN(
+          rclcpp::get_logger("TeknicSystemHardware"),
+          "Port %zu missed the read deadline (%lu total)", worker->port, worker->total_misses);
+      }
+      if (worker->consecutive_misses >= max_read_misses_)
+      {
+        RCLCPP_ERROR(
+          rclcpp::get_logger("TeknicSystemHardware"),
+          "Port %zu missed the read deadline %u times in a row",
+          worker->port, worker->consecutive_misses);
+        failed = true;
+      }
+    }
+    for (std::size_t i : worker->joints)
+    {
+      hw_states_stale_[i] = worker->consecutive_misses > 0;
+    }
+  }
+  if (failed)
+  {
+    return hardware_interface::return_type::ERROR;
+  }
+
+  // the joints were sampled one after another, optionally bring them to a common instant
+  for (std::size_t i = 0; i < info_.joints.size(); i++)
+  {
+    const JointSample & sample = latest_samples_[i];
+    double age = now - sample.stamp;
+    hw_states_positions_[i] = sample.position;
+    if (extrapolate_position_ && std::isfinite(sample.velocity) && std::isfinite(age))
+    {
+      hw_states_positions_[i] += sample.velocity * age;
+    }
+    hw_states_velocities_[i] = sample.velocity;
+    hw_states_efforts_[i] = sample.effort;
+    hw_states_ages_[i] = age;
+  }
+
+  if (attention_)
+  {
+    for (std::size_t i = 0; i < info_.joints.size(); i++)
+    {
+      mnStatusReg events;
+      events.attnBits = attn_events_[i].exchange(0);
+      if (events.cpm.MoveDone)
+      {
+        hw_states_move_done_[i] = 1;
+      }
+      if ((events.cpm.NotReady || events.cpm.UserAlert) && hw_states_faults_[i] != 1)
+      {
+        RCLCPP_WARN(
+          rclcpp::get_logger("TeknicSystemHardware"),
+          "Joint %zu reported a fault (not ready or alert)", i);
+        hw_states_faults_[i] = 1;
+      }
+    }
+  }
+
+  // without attention move_done follows the predicted move end, confirmed by the node at a low rate
+  try
+  {
+    for (std::size_t i = 0; i < info_.joints.size(); i++)
+    {
+      if (!predicts_moves(i))
+      {
+        continue;
+      }
+      double remaining = std::max(0.0, move_ends_[i] - now);
+      hw_states_time_to_target_[i] = remaining;
+      if (attention_ || !read_sets_[i].move_done || hw_states_move_done_[i] == 1)
+      {
+        continue;
+      }
+      if (remaining > 0)
+      {
+        hw_states_move_done_[i] = 0;
+      }
+      else if (now >= next_move_checks_[i])
+      {
+        next_move_checks_[i] = now + move_done_check_;
+        if (handles_[i].node->Motion.MoveIsDone())
+        {
+          hw_states_move_done_[i] = 1;
+        }
+      }
+    }
+  }
+  catch(sFnd::mnErr& theErr)
+  {
+    RCLCPP_ERROR(
+      rclcpp::get_logger("TeknicSystemHardware"),
+      "Caught error: addr=%d, err=0x%08x\nmsg=%s\n", theErr.TheAddr, theErr.ErrorCode, theErr.ErrorMsg);
+    return hardware_interface::return_type::ERROR;
+  }
+
+  for (std::size_t i = 0; i < info_.joints.size(); i++)
+  {
+    if (read_only_[i])
+    {
+      // RCLCPP_INFO(
+      //   rclcpp::get_logger("TeknicSystemHardware"),
+      //   "pos: %f, vel: %f, torque: %f",
+      //   hw_states_positions_[i], hw_states_velocities_[i], hw_states_efforts_[i]);
+      RCLCPP_INFO(
+        rclcpp::get_logger("TeknicSystemHardware"),
+        "Joint %lu: pos: %f",
+        i, hw_states_positions_[i]);
+    }
+  }
+
+  return hardware_interface::return_type::OK;
+}
+
+hardware_interface::return_type TeknicSystemHardware::write(
+  const rclcpp::Time & /*time*/, const rclcpp::Duration & period)
+{
+  bool failed = false;
+  for (auto & worker : command_workers_)
+  {
+    if (worker->failed.exchange(false))
+    {
+      std::lock_guard<std::mutex> lock(worker->mutex);
+      sFnd::mnErr & theErr = worker->error;
+      RCLCPP_ERROR(
+        rclcpp::get_logger("TeknicSystemHardware"),
+        "Caught error: addr=%d, err=0x%08x\nmsg=%s\n", theErr.TheAddr, theErr.ErrorCode, theErr.ErrorMsg);
+      failed = true;
+    }
+  }
+  if (failed)
+  {
+    return hardware_interface::return_type::ERROR;
+  }
+
+  if (link_governor_)
+  {
+    for (PortGovernor & governor : governors_)
+    {
+      double transactions = period.seconds() * link_budget_ / governor.transaction.load();
+      governor.budget = std::max<std::size_t>(1, static_cast<std::size_t>(transactions));
+      governor.sent = 0;
+      governor.deferred = 0;
+    }
+  }
+
+  pending_triggers_.clear();
+  try
+  {
+    for (std::size_t n = 0; n < handles_.size(); n++)
+    {
+      std::size_t i = (n + write_offset_) % handles_.size();
+      const JointHandle & handle = handles_[i];
+      if (!handle.read_only)
+      {
+        // settings first, they apply to the move sent below
+        bool settings_changed = false;
+        for (std::size_t s = 0; s < SETTING_COUNT; s++)
+        {
+          double value = hw_commands_settings_[i][s];
+          if (!std::isnan(value) && value != applied_settings_[i][s])
+          {
+            if (!async_write_)
+            {
+              apply_setting(handle, static_cast<setting_t>(s), value);
+            }
+            applied_settings_[i][s] = value;
+            settings_changed = true;
+          }
+        }
+        if (settings_changed && async_write_)
+        {
+          queued_commands_[i].settings = applied_settings_[i];
+          queued_commands_[i].settings_seq++;
+        }
+        if (settings_changed && !handle.streaming)
+        {
+          // resend the current target so that the running move picks up the new limits
+          sent_commands_[i] = SentCommand();
+        }
+
+        switch (control_mode_[i])
+        {
+          case UNDEFINED:
+          {
+            // RCLCPP_INFO(
+            //   rclcpp::get_logger("TeknicSystemHardware"),
+            //   "Nothing is using the hardware interface!");
+            break;
+          }
+          case SPEED_LOOP:
+          {
+            if (!std::isnan(hw_commands_velocities_[i]))
+            {
+              double target = hw_commands_velocities_[i] * handle.to_counts;
+              // RCLCPP_INFO(
+              //   rclcpp::get_logger("TeknicSystemHardware"),
+              //   "target vel: %i", target);
+              if (command_changed(i, target, velocity_deadbands_[i]))
+              {
+                send_command(i, SPEED_LOOP, target);
+                predict_move(i, SPEED_LOOP, target);
+                hw_states_move_done_[i] = 0;
+              }
+            }
+            break;
+          }
+          case POSITION_LOOP:
+          {
+            if (!std::isnan(hw_commands_positions_[i]))
+            {
+              double target = hw_commands_positions_[i] * handle.to_counts;
+              // RCLCPP_INFO(
+              //   rclcpp::get_logger("TeknicSystemHardware"),
+              //   "target pos: %i", target);
+              if (command_changed(i, target, position_deadbands_[i]))
+              {
+                send_command(i, POSITION_LOOP, target);
+                predict_move(i, POSITION_LOOP, target);
+                hw_states_move_done_[i] = 0;
+              }
+            }
+            break;
+          }
+          case SEGMENT_STREAM:
+          {
+            Stream & stream = streams_[i];
+            double id = hw_commands_segment_ids_[i];
+            if (!std::isnan(id) && id != stream.last_id && !std::isnan(hw_commands_segments_[i]))
+            {
+              stream.last_id = id;
+              if (stream.pending.size() < MOVE_BUFFER_DEPTH)
+              {
+                stream.pending.push_back(hw_commands_segments_[i] * handle.to_counts);
+                stream.overflow = false;
+                hw_states_move_done_[i] = 0;
+              }
+              else if (!stream.overflow)
+              {
+                // the controller has to watch segments_queued, report once per overrun
+                stream.overflow = true;
+                RCLCPP_WARN(
+                  rclcpp::get_logger("TeknicSystemHardware"),
+                  "Segment queue of joint %s is full, segments are dropped",
+                  info_.joints[i].name.c_str());
+              }
+            }
+            break;
+          }
+        }
+        if (handle.streaming)
+        {
+          feed_stream(i);
+          if (!streams_[i].finish.empty())
+          {
+            move_ends_[i] = streams_[i].finish.back();
+          }
+          hw_states_segments_queued_[i] =
+            static_cast<double>(streams_[i].pending.size() + streams_[i].finish.size());
+        }
+      }
+    }
+
+    // one broadcast per group starts all loaded moves together
+    for (const auto & trigger : pending_triggers_)
+    {
+      myMgr->Ports(trigger.first).Adv.TriggerMovesInGroup(trigger.second);
+    }
+  }
+  catch(sFnd::mnErr& theErr)
+  {
+    RCLCPP_ERROR(
+      rclcpp::get_logger("TeknicSystemHardware"),
+      "Caught error: addr=%d, err=0x%08x\nmsg=%s\n", theErr.TheAddr, theErr.ErrorCode, theErr.ErrorMsg);
+    return hardware_interface::return_type::ERROR;
+  }
+
+  if (link_governor_)
+  {
+    bool deferred = false;
+    for (PortGovernor & governor : governors_)
+    {
+      double ratio = static_cast<double>(governor.sent + governor.deferred) /
+        std::max<std::size_t>(1, governor.sent);
+      governor.decimation += 0.1 * (ratio - governor.decimation);
+      deferred = deferred || governor.deferred != 0;
+    }
+    for (std::size_t i = 0; i < handles_.size(); i++)
+    {
+      hw_states_write_decimation_[i] = governors_[handles_[i].port].decimation;
+    }
+    if (deferred)
+    {
+      write_offset_++;
+    }
+  }
+
+  // hand the complete command set of every port to its sender
+  for (auto & worker : command_workers_)
+  {
+    std::vector<QueuedCommand> & buffer = worker->buffer.back();
+    for (std::size_t k = 0; k < worker->joints.size(); k++)
+    {
+      buffer[k] = queued_commands_[worker->joints[k]];
+    }
+    worker->buffer.publish();
+    // taking the mutex orders the publish against the sender's wait, so no wakeup is lost
+    {
+      std::lock_guard<std::mutex> lock(worker->mutex);
+    }
+    worker->cv.notify_one();
+  }
+
+  return hardware_interface::return_type::OK;
+}
+
+void TeknicSystemHardware::send_command(std::size_t i, control_mode_t mode, double target)
+{
+  if (async_write_)
+  {
+    QueuedCommand & queued = queued_commands_[i];
+    queued.mode = mode;
+    queued.target = target;
+    queued.seq++;
+    return;
+  }
+  double start = steady_seconds();
+  start_move(handles_[i], mode, target);
+  measure_transaction(handles_[i].port, steady_seconds() - start);
+  if (handles_[i].trigger_group != 0)
+  {
+    add_trigger(handles_[i]);
+  }
+}
+
+void TeknicSystemHardware::measure_transaction(std::size_t port, double seconds)
+{
+  std::atomic<double> & transaction = governors_[port].transaction;
+  transaction.store(transaction.load() + 0.1 * (seconds - transaction.load()));
+}
+
+void TeknicSystemHardware::apply_setting(
+  const JointHandle & handle, setting_t setting, double value)
+{
+  sFnd::INode & inode = *handle.node;
+  switch (setting)
+  {
+    case VEL_LIMIT:
+    {
+      inode.Motion.VelLimit = value * handle.to_counts;
+      break;
+    }
+    case ACC_LIMIT:
+    {
+      inode.Motion.AccLimit = value * handle.to_counts;
+      break;
+    }
+    case JERK_LIMIT:
+    {
+      // runtime commands are not validated like the URDF value, keep them in the register range
+      double limit = std::min<double>(
+        std::max(0.0, std::round(value)), std::numeric_limits<unsigned>::max());
+      inode.Motion.JrkLimit = static_cast<unsigned>(limit);
+      break;
+    }
+    case SETTING_COUNT:
+    {
+      break;
+    }
+  }
+}
+
+std::size_t TeknicSystemHardware::start_move(
+  const JointHandle & handle, control_mode_t mode, double target)
+{
+  sFnd::INode & inode = *handle.node;
+  bool triggered = handle.trigger_group != 0;
+  if (mode == SPEED_LOOP)
+  {
+    if (triggered)
+    {
+      return inode.Motion.Adv.MoveVelStart(target, true);
+    }
+    return inode.Motion.MoveVelStart(target);
+  }
+  if (mode == POSITION_LOOP)
+  {
+    switch (handle.profile)
+    {
+      case TRAPEZOIDAL:
+      {
+        if (triggered)
+        {
+          return inode.Motion.Adv.MovePosnStart(target, true, true);
+        }
+        return inode.Motion.MovePosnStart(target, true);
+      }
+      case ASYMMETRIC:
+      {
+        return inode.Motion.Adv.MovePosnAsymStart(target, true, triggered);
+      }
+      case HEAD_TAIL:
+      {
+        return inode.Motion.Adv.MovePosnHeadTailStart(
+          target, true, triggered, handle.has_head, handle.has_tail);
+      }
+    }
+  }
+  return 0;
+}
+
+double TeknicSystemHardware::move_duration_msec(const JointHandle & handle, double distance)
+{
+  sFnd::INode & inode = *handle.node;
+  switch (handle.profile)
+  {
+    case ASYMMETRIC:
+    {
+      return inode.Motion.Adv.MovePosnAsymDurationMsec(distance, false);
+    }
+    case HEAD_TAIL:
+    {
+      return inode.Motion.Adv.MovePosnHeadTailDurationMsec(
+        distance, false, handle.has_head, handle.has_tail);
+    }
+    default:
+    {
+      return inode.Motion.MovePosnDurationMsec(distance, false);
+    }
+  }
+}
+
+bool TeknicSystemHardware::predicts_moves(std::size_t i) const
+{
+  return read_sets_[i].time_to_target || (read_sets_[i].move_done && !attention_);
+}
+
+void TeknicSystemHardware::predict_move(std::size_t i, control_mode_t mode, double target)
+{
+  if (!predicts_moves(i))
+  {
+    return;
+  }
+  const JointHandle & handle = handles_[i];
+  double duration = 0;
+  if (mode == SPEED_LOOP)
+  {
+    duration = handle.node->Motion.MoveVelDurationMsec(target);
+  }
+  else
+  {
+    double from = hw_states_positions_[i] * handle.to_counts;
+    if (!std::isnan(from))
+    {
+      duration = move_duration_msec(handle, target - from);
+    }
+  }
+  move_ends_[i] = steady_seconds() + duration / 1000;
+}
+
+void TeknicSystemHardware::feed_stream(std::size_t i)
+{
+  const JointHandle & handle = handles_[i];
+  Stream & stream = streams_[i];
+
+  // segments whose predicted end has passed have left the move buffer
+  double now = steady_seconds();
+  while (!stream.finish.empty() && stream.finish.front() <= now)
+  {
+    stream.finish.pop_front();
+    stream.free = std::min(stream.free + 1, MOVE_BUFFER_DEPTH);
+  }
+
+  while (!stream.pending.empty() && stream.free > 0)
+  {
+    double target = stream.pending.front();
+    double from = stream.last_target;
+    if (std::isnan(from))
+    {
+      from = hw_states_positions_[i] * handle.to_counts;
+    }
+    double duration = 0;
+    if (!std::isnan(from))
+    {
+      duration = move_duration_msec(handle, target - from) / 1000;
+    }
+
+    // the node reports how many more moves it accepts, trust it over the prediction
+    stream.free = std::min(start_move(handle, POSITION_LOOP, target), MOVE_BUFFER_DEPTH);
+    double start = stream.finish.empty() ? now : std::max(now, stream.finish.back());
+    stream.finish.push_back(start + duration);
+    stream.last_target = target;
+    stream.pending.pop_front();
+  }
+}
+
+void TeknicSystemHardware::add_trigger(const JointHandle & handle)
+{
+  std::pair<std::size_t, std::size_t> trigger(handle.port, handle.trigger_group);
+  if (std::find(pending_triggers_.begin(), pending_triggers_.end(), trigger) ==
+    pending_triggers_.end())
+  {
+    pending_triggers_.push_back(trigger);
+  }
+}
+
+bool TeknicSystemHardware::command_changed(std::size_t i, double target, double deadband)
+{
+  SentCommand & sent = sent_commands_[i];
+  sent.cycles++;
+  if (!std::isnan(sent.target) && std::abs(target - sent.target) <= deadband &&
+    (keep_alive_cycles_ == 0 || sent.cycles < keep_alive_cycles_))
+  {
+    return false;
+  }
+  // out of link budget, the command stays pending and the newest target is sent later
+  if (link_governor_ && !handles_[i].streaming)
+  {
+    PortGovernor & governor = governors_[handles_[i].port];
+    if (governor.sent >= governor.budget)
+    {
+      governor.deferred++;
+      return false;
+    }
+    governor.sent++;
+  }
+  // written before sending, a failed command is retried after reactivation anyway
+  sent.target = target;
+  sent.cycles = 0;
+  return true;
 }
 
 }  // namespace teknic_hardware